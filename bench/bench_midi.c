@@ -0,0 +1,138 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decoder throughput.
+ *
+ * Builds a track of note events (running status included) with a few
+ * meta events in memory, reads it with midi_read_track() several times
+ * and prints the best rate in events/s. With BENCH_UNCHECKED it is built
+ * against the decoder from before the end-bounded one, kept in
+ * bench/unchecked, so "make bench" prints both rates side by side.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "midi.h"
+
+#define BENCH_NOTES 500000
+#define BENCH_RUNS  9
+
+/* The unchecked decoder has no padding, but gets the same buffer */
+#ifndef MIDI_PAD
+#define MIDI_PAD 16
+#endif
+
+/* Bytes of one NOTE ON and NOTE OFF pair, with running status */
+#define NOTE_BYTES  7
+
+static uint8_t* put_tempo(uint8_t *b)
+{
+    static const uint8_t tempo[] = { 0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20 };
+
+    memcpy(b, tempo, sizeof(tempo));
+    return b + sizeof(tempo);
+}
+
+/* Track chunk of BENCH_NOTES notes; *num gets its number of events */
+static size_t build_track(uint8_t *buf, int *num)
+{
+    uint8_t *b = buf + 8;
+    uint32_t len;
+    int i;
+
+    *num = 0;
+    b = put_tempo(b);
+    (*num)++;
+    for(i = 0; i < BENCH_NOTES; i++) {
+        if(i % 10000 == 0) {
+            b = put_tempo(b);
+            (*num)++;
+        }
+        /* dt, NOTE ON, key, vel; dt, key, 0 as a running NOTE OFF */
+        *b++ = 0x10;
+        *b++ = 0x90;
+        *b++ = 40 + i % 48;
+        *b++ = 100;
+        *b++ = 0x10;
+        *b++ = 40 + i % 48;
+        *b++ = 0;
+        *num += 2;
+    }
+    *b++ = 0x00;
+    *b++ = 0xFF;
+    *b++ = 0x2F;
+    *b++ = 0x00;
+    (*num)++;
+
+    len = b - buf - 8;
+    memcpy(buf, "MTrk", 4);
+    buf[4] = len >> 24;
+    buf[5] = len >> 16;
+    buf[6] = len >> 8;
+    buf[7] = len;
+    return b - buf;
+}
+
+int main(void)
+{
+    uint8_t *mem, *buf;
+    size_t size;
+    midi_header_t h;
+    midi_track_t t;
+    void *p;
+    clock_t c;
+    double secs, best;
+    int num, i;
+
+    size = 8 + 4 + (BENCH_NOTES / 10000 + 2) * 7 + BENCH_NOTES * NOTE_BYTES;
+    mem = calloc(1, size + MIDI_PAD + 256);
+    /* The unchecked decoder skips the chunk header by adding to the low
+     * byte of the pointer, so start where that cannot carry */
+    buf = mem + (256 - (uintptr_t) mem % 256);
+    size = build_track(buf, &num);
+
+    memset(&h, 0, sizeof(h));
+    h.time_div[1] = 96;
+    best = 0;
+    for(i = 0; i < BENCH_RUNS; i++) {
+        p = buf;
+        c = clock();
+#ifdef BENCH_UNCHECKED
+        t = midi_read_track(&p, &h);
+#else
+        t = midi_read_track(&p, buf + size, &h);
+#endif
+        secs = (double)(clock() - c) / CLOCKS_PER_SEC;
+        if(t.num_events != num) {
+            fprintf(stderr,"error: read %d events of %d\n", t.num_events, num);
+            return 1;
+        }
+        midi_free_track(&t);
+        if(secs > 0 && (best == 0 || secs < best))
+            best = secs;
+    }
+    printf("%d events, best of %d runs: %.2f M events/s\n", num, BENCH_RUNS,
+           best > 0 ? num / best / 1e6 : 0.0);
+    free(mem);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bank.h"
+
+#define ALIGN(x) (((x) + BANK_ALIGN - 1) & ~(uint32_t)(BANK_ALIGN - 1))
+
+/* Deduplicated table of words */
+typedef struct
+{
+    uint16_t *words;
+    int num;
+
+} bank_table_t;
+
+static int cmp_u16(const void *a, const void *b)
+{
+    return *(const uint16_t *) a - *(const uint16_t *) b;
+}
+
+/* Collect packet word w of every song into a sorted table without repeats */
+static void build_table(bank_table_t *t, chip16_packets_t *songs,
+                        int num_songs, int w)
+{
+    int i, j, n;
+
+    for(i = n = 0; i < num_songs; i++)
+        n += songs[i].num;
+    t->words = malloc((n + 1) * sizeof(uint16_t));
+    for(i = n = 0; i < num_songs; i++) {
+        for(j = 0; j < songs[i].num; j++)
+            t->words[n++] = songs[i].packets[j * CHIP16_PACKET_WORDS + w];
+    }
+    qsort(t->words, n, sizeof(uint16_t), cmp_u16);
+    for(i = t->num = 0; i < n; i++) {
+        if(!t->num || t->words[t->num - 1] != t->words[i])
+            t->words[t->num++] = t->words[i];
+    }
+}
+
+static int table_index(bank_table_t *t, uint16_t v)
+{
+    uint16_t *w = bsearch(&v, t->words, t->num, sizeof(uint16_t), cmp_u16);
+
+    return w - t->words;
+}
+
+static void put16(uint8_t *b, uint32_t pos, uint16_t v)
+{
+    b[pos] = v & 0xFF;
+    b[pos + 1] = v >> 8;
+}
+
+/* Lay out the bank in memory; returns its size */
+static uint32_t pack_bank(uint8_t **bank, chip16_packets_t *songs,
+                          int num_songs, bank_table_t *pitches,
+                          bank_table_t *envs)
+{
+    uint32_t pos, pitch_ofs, env_ofs, size;
+    uint8_t *b;
+    int16_t *p;
+    int i, j;
+
+    pitch_ofs = ALIGN(2 * BANK_HDR_WORDS + 4 * num_songs);
+    env_ofs = ALIGN(pitch_ofs + 2 * pitches->num);
+    size = ALIGN(env_ofs + 2 * envs->num);
+    for(i = 0; i < num_songs; i++)
+        size = ALIGN(size + 2 * BANK_PACKET_WORDS * songs[i].num);
+    if(size > BANK_MAX_SIZE)
+        return size;
+
+    *bank = b = calloc(1, size);
+    memcpy(b, BANK_MAGIC, 4);
+    put16(b, 4, num_songs);
+    put16(b, 6, pitches->num);
+    put16(b, 8, envs->num);
+    put16(b, 10, pitch_ofs);
+    put16(b, 12, env_ofs);
+    for(i = 0; i < pitches->num; i++)
+        put16(b, pitch_ofs + 2 * i, pitches->words[i]);
+    for(i = 0; i < envs->num; i++)
+        put16(b, env_ofs + 2 * i, envs->words[i]);
+
+    pos = ALIGN(env_ofs + 2 * envs->num);
+    for(i = 0; i < num_songs; i++) {
+        put16(b, 2 * BANK_HDR_WORDS + 4 * i, pos);
+        put16(b, 2 * BANK_HDR_WORDS + 4 * i + 2, songs[i].num);
+        for(j = 0; j < songs[i].num; j++) {
+            p = songs[i].packets + j * CHIP16_PACKET_WORDS;
+            put16(b, pos, p[0]);
+            put16(b, pos + 2, p[2]);
+            put16(b, pos + 4, table_index(envs, p[3]) << 8 |
+                              table_index(pitches, p[1]));
+            pos += 2 * BANK_PACKET_WORDS;
+        }
+        pos = ALIGN(pos);
+    }
+
+    return size;
+}
+
+int bank_write(const char *fn_bank, char **fn_mids, int num_mids, int track,
+               chip16_opts_t *opts)
+{
+    FILE *f;
+    chip16_packets_t *songs;
+    bank_table_t pitches, envs;
+    chip16_opts_t song_opts;
+    uint8_t *bank;
+    uint32_t size;
+    int i, ret;
+
+    /* Every song would overwrite the one seek table */
+    song_opts = *opts;
+    if(song_opts.fn_seek != NULL) {
+        printf("warning: no seek table in bank mode, ignoring %s\n",
+               song_opts.fn_seek);
+        song_opts.fn_seek = NULL;
+    }
+    songs = calloc(num_mids, sizeof(chip16_packets_t));
+    pitches.words = envs.words = NULL;
+    bank = NULL;
+    ret = -1;
+
+    for(i = 0; i < num_mids; i++) {
+        if((f = fopen(fn_mids[i], "rb")) == NULL) {
+            printf("error: MIDI file %s could not be opened\n", fn_mids[i]);
+            goto out;
+        }
+        printf("song %d: '%s' ... ", i, fn_mids[i]);
+        ret = chip16_convert_stream(f, track, &song_opts, chip16_packets_sink,
+                                    &songs[i]);
+        printf("done.\n");
+        fclose(f);
+        if(ret < 0)
+            goto out;
+    }
+
+    build_table(&pitches, songs, num_mids, 1);
+    build_table(&envs, songs, num_mids, 3);
+    ret = -1;
+    if(pitches.num > BANK_MAX_INDEX || envs.num > BANK_MAX_INDEX) {
+        printf("error: bank needs %d pitches and %d envelopes, max %d each\n",
+               pitches.num, envs.num, BANK_MAX_INDEX);
+        goto out;
+    }
+    size = pack_bank(&bank, songs, num_mids, &pitches, &envs);
+    if(size > BANK_MAX_SIZE) {
+        printf("error: bank would be %u bytes, over the %u byte address space\n",
+               size, BANK_MAX_SIZE);
+        goto out;
+    }
+
+    if((f = fopen(fn_bank, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_bank);
+        goto out;
+    }
+    fwrite(bank, 1, size, f);
+    fclose(f);
+    printf("wrote %d songs, %d pitches, %d envelopes, %u bytes to '%s'\n",
+           num_mids, pitches.num, envs.num, size, fn_bank);
+    ret = 1;
+
+out:
+    for(i = 0; i < num_mids; i++)
+        free(songs[i].packets);
+    free(songs);
+    free(pitches.words);
+    free(envs.words);
+    free(bank);
+
+    return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BANK_H
+#define BANK_H
+
+/*
+ * Sound banks: many songs packed into one blob for a Chip16 program.
+ *
+ * All fields are little-endian 16-bit words, as the Chip16 reads them:
+ *
+ *   header    "MB16", songs, pitches, envelopes, pitch table offset,
+ *             envelope table offset, 0
+ *   songs     per song: offset of its first packet, number of packets
+ *   pitches   frequencies in Hz, sorted, each used at least once
+ *   envelopes ADSR words, sorted, each used at least once
+ *   packets   per note: delay, duration, envelope index << 8 | pitch index
+ *
+ * Offsets are from the start of the bank, and every table and song starts
+ * on a BANK_ALIGN boundary. A bank must fit the Chip16 address space.
+ */
+
+#include "chip16.h"
+
+#define BANK_MAGIC      "MB16"
+#define BANK_HDR_WORDS  8
+#define BANK_ALIGN      4
+#define BANK_MAX_SIZE   0x10000
+/* Pitch and envelope indices are bytes */
+#define BANK_MAX_INDEX  0x100
+#define BANK_PACKET_WORDS 3
+
+/* Convert the given track of each MIDI file into a bank */
+int bank_write(const char *fn_bank, char **fn_mids, int num_mids, int track,
+               chip16_opts_t *opts);
+
+#endif
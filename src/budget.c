@@ -0,0 +1,219 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "budget.h"
+#include "stream.h"
+
+/* Bytes read from the MIDI file at a time */
+#define READ_CHUNK 4096
+
+/* Length of the MThd fields */
+#define HDR_BODY_SIZE 6
+
+/* Fewest pending notes kept in memory */
+#define MIN_NOTES 16
+
+/* Markers kept for a seek table; later ones are dropped */
+#define MAX_MARKERS 32
+
+/* Buffer size of the output and spill files */
+#define IO_BUF 1024
+
+/* Heap used by the C library per open FILE, with its lock and wide
+ * character state, which sizeof(FILE) leaves out */
+#define FILE_SIZE 512
+
+typedef struct
+{
+    midi_stream_t stream;
+    chip16_file_conv_t fc;
+    /* Index of the track chunk being decoded */
+    int track;
+    /* Memory used besides the converter's allocations */
+    size_t fixed;
+    /* Canonical file header, fed to the decoder before each chunk */
+    uint8_t hdr[8 + HDR_BODY_SIZE];
+    uint8_t buf[READ_CHUNK];
+    char notes_io[IO_BUF];
+    char spill_io[IO_BUF];
+
+} budget_t;
+
+static uint32_t be32(const uint8_t *b)
+{
+    return (uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static size_t held_size(const chip16_opts_t *opts)
+{
+    return opts->xform.voice != CHIP16_VOICE_ALL ?
+           NUM_CHANNELS * NUM_NOTES * sizeof(chip16_held_t) : 0;
+}
+
+/* Most memory used so far; every part only grows until the end */
+static size_t mem_peak(budget_t *b)
+{
+    chip16_conv_t *c = &b->fc.conv;
+
+    return b->fixed + c->notes_peak +
+           c->cap_markers * sizeof(chip16_marker_t);
+}
+
+static void budget_event(void *ctx, int track, midi_event_t *e)
+{
+    budget_t *b = ctx;
+
+    chip16_file_conv_event(&b->fc, hdr_tdiv_le(&b->stream.hdr), b->track, e);
+}
+
+/* Skip len bytes of input, which may not be seekable */
+static int skip_bytes(budget_t *b, FILE *f, uint32_t len)
+{
+    size_t n;
+
+    if(len <= (uint32_t) 0x7FFFFFFF && !fseek(f, (long) len, SEEK_CUR))
+        return 0;
+    for(; len; len -= n) {
+        n = len < READ_CHUNK ? len : READ_CHUNK;
+        if(fread(b->buf, 1, n, f) != n)
+            return -1;
+    }
+    return 0;
+}
+
+/* Decode the track chunk whose header is in chunk; returns the error */
+static int decode_chunk(budget_t *b, FILE *f, const uint8_t *chunk)
+{
+    uint32_t len = be32(chunk + 4);
+    size_t n;
+    int err = MIDI_STREAM_OK;
+
+    midi_stream_init(&b->stream, budget_event, b);
+    midi_stream_feed(&b->stream, b->hdr, sizeof(b->hdr));
+    midi_stream_feed(&b->stream, chunk, 8);
+    for(; len; len -= n) {
+        n = len < READ_CHUNK ? len : READ_CHUNK;
+        if((n = fread(b->buf, 1, n, f)) == 0)
+            break;
+        if((err = midi_stream_feed(&b->stream, b->buf, n)))
+            break;
+    }
+    /* Drop the rest of a broken chunk */
+    if(err)
+        skip_bytes(b, f, len - n);
+    if(!err)
+        err = midi_stream_finish(&b->stream);
+    if(err)
+        printf("warning: track %d: MIDI stream error %d near byte %u of "
+               "the chunk\n", b->track, err,
+               b->stream.offset - (uint32_t) sizeof(b->hdr));
+
+    return err;
+}
+
+int budget_write(FILE *fmid, const char *fn_notes, int track,
+                 chip16_opts_t *opts, size_t max_memory)
+{
+    budget_t b;
+    uint8_t chunk[8];
+    uint32_t hdr_size;
+    size_t reserve, peak;
+    FILE *fnotes, *spill;
+    int ret;
+
+    memset(&b, 0, sizeof(b));
+    /* Reads go through b.buf, or are chunk headers */
+    setvbuf(fmid, NULL, _IONBF, 0);
+    if(fread(b.hdr, 1, sizeof(b.hdr), fmid) != sizeof(b.hdr) ||
+       memcmp(b.hdr, "MThd", 4) ||
+       (hdr_size = be32(b.hdr + 4)) < HDR_BODY_SIZE ||
+       skip_bytes(&b, fmid, hdr_size - HDR_BODY_SIZE) < 0) {
+        printf("error: not a MIDI file\n");
+        return -1;
+    }
+    /* Fields past those we know are left out */
+    b.hdr[4] = b.hdr[5] = b.hdr[6] = 0;
+    b.hdr[7] = HDR_BODY_SIZE;
+
+    /* The input, output and spill FILEs, and the buffer of stdout, which
+     * the progress messages use, are allocated by the library */
+    b.fixed = sizeof(b) + 3 * FILE_SIZE + BUFSIZ + held_size(opts);
+    reserve = opts->fn_seek != NULL ?
+              MAX_MARKERS * sizeof(chip16_marker_t) : 0;
+    if(max_memory < b.fixed + reserve + MIN_NOTES * sizeof(chip16_note_t)) {
+        printf("error: memory budget too small, need at least %lu bytes\n",
+               (unsigned long)(b.fixed + reserve +
+                               MIN_NOTES * sizeof(chip16_note_t)));
+        return -1;
+    }
+
+    if((fnotes = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
+        return -2;
+    }
+    if((spill = tmpfile()) == NULL) {
+        printf("error: could not create a temporary file\n");
+        fclose(fnotes);
+        return -2;
+    }
+    setvbuf(fnotes, b.notes_io, _IOFBF, IO_BUF);
+    setvbuf(spill, b.spill_io, _IOFBF, IO_BUF);
+    chip16_file_conv_init(&b.fc, track, opts, chip16_file_sink, fnotes);
+    b.fc.conv.spill = spill;
+    b.fc.conv.max_notes = (max_memory - b.fixed - reserve) /
+                          sizeof(chip16_note_t);
+    if(reserve) {
+        b.fc.conv.markers = malloc(reserve);
+        b.fc.conv.cap_markers = b.fc.conv.max_markers = MAX_MARKERS;
+    }
+    ret = 1;
+
+    for(b.track = 0; b.track <= track &&
+        fread(chunk, 1, sizeof(chunk), fmid) == sizeof(chunk);) {
+        if(memcmp(chunk, "MTrk", 4)) {
+            if(skip_bytes(&b, fmid, be32(chunk + 4)) < 0)
+                break;
+            continue;
+        }
+        /* Only earlier tracks may hold markers for the seek table */
+        if(b.track == track || opts->fn_seek != NULL) {
+            if(decode_chunk(&b, fmid, chunk))
+                ret = -1;
+        } else if(skip_bytes(&b, fmid, be32(chunk + 4)) < 0) {
+            break;
+        }
+        b.track++;
+    }
+
+    peak = mem_peak(&b);
+    if(chip16_file_conv_finish(&b.fc) < 0)
+        ret = -1;
+    if(b.fc.conv.dropped_markers)
+        printf("warning: %d markers over the budget dropped\n",
+               b.fc.conv.dropped_markers);
+    printf("peak memory %lu of %lu bytes, %u notes spilled, ",
+           (unsigned long) peak, (unsigned long) max_memory,
+           b.fc.conv.total_spilled);
+    fclose(spill);
+    fclose(fnotes);
+
+    return ret;
+}
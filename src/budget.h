@@ -0,0 +1,44 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+/*
+ * Conversion of one track within a memory budget, for huge files.
+ *
+ * The file is never held in memory: chunks are read in turn, those that
+ * cannot affect the track are skipped unread, and the others are decoded
+ * through a fixed-size buffer, one event at a time. Pending notes past
+ * what the budget allows are spilled to a temporary file (see
+ * chip16_conv_t). The budget covers the conversion's own data: the
+ * decoder and converter state, the file structures and their buffers,
+ * the note queue, counting both arrays while it grows, and room for a
+ * few markers for a seek table, past which markers are dropped.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "chip16.h"
+
+/* As chip16_write_stream(), using at most max_memory bytes; prints the
+ * peak memory used */
+int budget_write(FILE *fmid, const char *fn_notes, int track,
+                 chip16_opts_t *opts, size_t max_memory);
+
+#endif
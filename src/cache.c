@@ -0,0 +1,309 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "stream.h"
+
+/* Bytes read from the MIDI file at a time */
+#define READ_CHUNK 65536
+
+/* Length of the MThd fields */
+#define HDR_BODY_SIZE 6
+
+/* Cached conversion of a track */
+typedef struct
+{
+    uint64_t hash;
+    chip16_packets_t p;
+
+} cache_track_t;
+
+typedef struct
+{
+    uint64_t key;
+    cache_track_t *tracks;
+    int num;
+
+} cache_t;
+
+/* Converting one track chunk */
+typedef struct
+{
+    midi_stream_t stream;
+    chip16_file_conv_t fc;
+
+} track_conv_t;
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *b = data;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ b[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+#define FNV64_BASIS 0xcbf29ce484222325ULL
+
+/* Hash the options field by field, leaving out the padding between them */
+static uint64_t hash_xform(uint64_t h, const chip16_xform_t *xf)
+{
+    h = fnv1a64(h, &xf->transpose, sizeof(xf->transpose));
+    h = fnv1a64(h, &xf->tempo, sizeof(xf->tempo));
+    h = fnv1a64(h, &xf->min_vel, sizeof(xf->min_vel));
+    h = fnv1a64(h, &xf->channels, sizeof(xf->channels));
+    h = fnv1a64(h, &xf->key_lo, sizeof(xf->key_lo));
+    h = fnv1a64(h, &xf->key_hi, sizeof(xf->key_hi));
+    h = fnv1a64(h, &xf->min_len, sizeof(xf->min_len));
+    h = fnv1a64(h, &xf->max_len, sizeof(xf->max_len));
+    h = fnv1a64(h, &xf->voice, sizeof(xf->voice));
+    h = fnv1a64(h, xf->chan_rank, sizeof(xf->chan_rank));
+    h = fnv1a64(h, &xf->env_index, sizeof(xf->env_index));
+    h = fnv1a64(h, &xf->drums, sizeof(xf->drums));
+
+    return h;
+}
+
+static uint32_t be32(const uint8_t *b)
+{
+    return (uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static uint8_t* read_file(FILE *f, size_t *size)
+{
+    uint8_t *buf = NULL;
+    size_t len, cap = 0;
+
+    *size = 0;
+    do {
+        if(*size + READ_CHUNK > cap) {
+            cap = cap ? cap * 2 : READ_CHUNK;
+            buf = realloc(buf, cap);
+        }
+        len = fread(buf + *size, 1, READ_CHUNK, f);
+        *size += len;
+    } while(len > 0);
+
+    return buf;
+}
+
+static void free_cache(cache_t *c)
+{
+    int t;
+
+    for(t = 0; t < c->num; t++)
+        free(c->tracks[t].p.packets);
+    free(c->tracks);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Load the cache, or leave it empty if missing or made for other input */
+static void load_cache(cache_t *c, const char *fn_cache, uint64_t key)
+{
+    FILE *f;
+    char magic[4];
+    uint32_t version, num;
+    uint64_t file_key;
+    cache_track_t *ct;
+    long size;
+    int t;
+
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    if((f = fopen(fn_cache, "rb")) == NULL)
+        return;
+    /* Counts are checked against the size, so a damaged file cannot make
+     * us allocate or read past what it holds */
+    if(fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+       fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return;
+    }
+    if(fread(magic, 1, 4, f) != 4 || memcmp(magic, CACHE_MAGIC, 4) ||
+       fread(&version, sizeof(version), 1, f) != 1 ||
+       version != CACHE_VERSION ||
+       fread(&file_key, sizeof(file_key), 1, f) != 1 || file_key != key ||
+       fread(&num, sizeof(num), 1, f) != 1 ||
+       num > size / (sizeof(ct->hash) + sizeof(ct->p.num)) ||
+       (c->tracks = calloc(num + 1, sizeof(cache_track_t))) == NULL) {
+        fclose(f);
+        return;
+    }
+
+    for(t = 0; t < num; t++) {
+        ct = &c->tracks[t];
+        if(fread(&ct->hash, sizeof(ct->hash), 1, f) != 1 ||
+           fread(&ct->p.num, sizeof(ct->p.num), 1, f) != 1 || ct->p.num < 0 ||
+           ct->p.num > size / (CHIP16_PACKET_WORDS * sizeof(int16_t)))
+            break;
+        ct->p.cap = ct->p.num;
+        ct->p.packets = malloc(((size_t) ct->p.num + 1) * CHIP16_PACKET_WORDS *
+                               sizeof(int16_t));
+        if(ct->p.packets == NULL)
+            break;
+        if(fread(ct->p.packets, CHIP16_PACKET_WORDS * sizeof(int16_t),
+                 ct->p.num, f) != ct->p.num) {
+            free(ct->p.packets);
+            break;
+        }
+    }
+    /* A damaged cache is as good as none */
+    c->num = t;
+    if(t < num)
+        free_cache(c);
+    fclose(f);
+}
+
+static int save_cache(const cache_t *c, const char *fn_cache)
+{
+    FILE *f;
+    uint32_t version = CACHE_VERSION, num = c->num;
+    int t;
+
+    if((f = fopen(fn_cache, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_cache);
+        return -2;
+    }
+    fwrite(CACHE_MAGIC, 1, 4, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&c->key, sizeof(c->key), 1, f);
+    fwrite(&num, sizeof(num), 1, f);
+    for(t = 0; t < c->num; t++) {
+        fwrite(&c->tracks[t].hash, sizeof(c->tracks[t].hash), 1, f);
+        fwrite(&c->tracks[t].p.num, sizeof(c->tracks[t].p.num), 1, f);
+        fwrite(c->tracks[t].p.packets, CHIP16_PACKET_WORDS * sizeof(int16_t),
+               c->tracks[t].p.num, f);
+    }
+    fclose(f);
+
+    return 1;
+}
+
+static void track_event(void *ctx, int track, midi_event_t *e)
+{
+    track_conv_t *tc = ctx;
+
+    chip16_file_conv_event(&tc->fc, hdr_tdiv_le(&tc->stream.hdr), track, e);
+}
+
+static void track_done(void *ctx, int track)
+{
+}
+
+/* Convert one track chunk, decoded after the file header */
+static int convert_chunk(const uint8_t *hdr, size_t hdr_len,
+                         const uint8_t *chunk, size_t chunk_len,
+                         chip16_opts_t *opts, chip16_packets_t *p)
+{
+    track_conv_t tc;
+    int err;
+
+    chip16_file_conv_init(&tc.fc, CHIP16_ALL_TRACKS, opts,
+                          chip16_packets_sink, p);
+    tc.fc.track_end = track_done;
+    midi_stream_init(&tc.stream, track_event, &tc);
+    midi_stream_feed(&tc.stream, hdr, hdr_len);
+    midi_stream_feed(&tc.stream, chunk, chunk_len);
+    if((err = midi_stream_finish(&tc.stream)))
+        printf("warning: MIDI stream error %d in track chunk\n", err);
+    chip16_file_conv_finish(&tc.fc);
+
+    return err ? -1 : 1;
+}
+
+int cache_write_all(FILE *fmid, const char *fn_notes, const char *fn_cache,
+                    chip16_opts_t *opts, int interleave)
+{
+    uint8_t *buf;
+    size_t size, pos, hdr_len, len;
+    cache_t old, cur;
+    cache_track_t *ct;
+    chip16_packets_t *packets;
+    int t, i, ret, redone;
+    uint64_t key;
+
+    buf = read_file(fmid, &size);
+    if(size < 8 + HDR_BODY_SIZE || memcmp(buf, "MThd", 4) ||
+       be32(buf + 4) < HDR_BODY_SIZE || be32(buf + 4) > size - 8) {
+        printf("error: not a MIDI file\n");
+        free(buf);
+        return -1;
+    }
+    hdr_len = 8 + be32(buf + 4);
+
+    key = fnv1a64(FNV64_BASIS, buf, hdr_len);
+    key = hash_xform(key, &opts->xform);
+    load_cache(&old, fn_cache, key);
+    memset(&cur, 0, sizeof(cur));
+    cur.key = key;
+    ret = 1;
+    redone = 0;
+
+    for(pos = hdr_len; pos + 8 <= size; pos += 8 + len) {
+        len = be32(buf + pos + 4);
+        if(len > size - pos - 8) {
+            printf("warning: chunk at byte %u runs past the end\n",
+                   (unsigned) pos);
+            len = size - pos - 8;
+        }
+        if(memcmp(buf + pos, "MTrk", 4))
+            continue;
+
+        cur.tracks = realloc(cur.tracks, (cur.num + 1) * sizeof(cache_track_t));
+        ct = &cur.tracks[cur.num++];
+        memset(ct, 0, sizeof(*ct));
+        ct->hash = fnv1a64(FNV64_BASIS, buf + pos, 8 + len);
+
+        /* Reuse an unchanged track, even if tracks moved around */
+        for(i = 0; i < old.num; i++) {
+            if(old.tracks[i].hash == ct->hash && old.tracks[i].p.packets) {
+                ct->p = old.tracks[i].p;
+                memset(&old.tracks[i].p, 0, sizeof(old.tracks[i].p));
+                break;
+            }
+        }
+        if(i < old.num)
+            continue;
+
+        printf("track %d: ", cur.num - 1);
+        if(convert_chunk(buf, hdr_len, buf + pos, 8 + len, opts, &ct->p) < 0)
+            ret = -1;
+        redone++;
+    }
+    printf("%d of %d tracks converted, ", redone, cur.num);
+
+    packets = malloc((cur.num + 1) * sizeof(chip16_packets_t));
+    for(t = 0; t < cur.num; t++)
+        packets[t] = cur.tracks[t].p;
+    if(chip16_write_tracks(fn_notes, packets, cur.num, interleave) < 0)
+        ret = -2;
+    free(packets);
+    /* Never keep the results of a broken track */
+    if(ret > 0)
+        save_cache(&cur, fn_cache);
+
+    free_cache(&old);
+    free_cache(&cur);
+    free(buf);
+
+    return ret;
+}
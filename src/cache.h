@@ -0,0 +1,48 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/*
+ * Incremental conversion of all tracks.
+ *
+ * The packets of each track are cached in a file, keyed by a hash of the
+ * track chunk's bytes. On the next run, only tracks whose bytes changed
+ * are decoded and converted again; the others are taken from the cache,
+ * and the outputs (one file per track, or the interleaved voices) are
+ * rebuilt from all of them. A track's packets depend only on its own
+ * events, as each follows its own tempo changes, and on the time
+ * division and conversion options, which invalidate the whole cache.
+ *
+ * The cache holds, in host byte order: "M16C", a format version, the
+ * hash of the header and options, the number of tracks, then per track
+ * its hash, number of packets and packets.
+ */
+
+#include <stdio.h>
+
+#include "chip16.h"
+
+#define CACHE_MAGIC     "M16C"
+#define CACHE_VERSION   1
+
+/* As chip16_write_all(), reusing and updating the cache in fn_cache */
+int cache_write_all(FILE *fmid, const char *fn_notes, const char *fn_cache,
+                    chip16_opts_t *opts, int interleave);
+
+#endif
@@ -15,13 +15,17 @@
  * along with midi16. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
 
 #include "chip16.h"
+#include "stream.h"
 
-#define NUM_NOTES 0x80
+/* Bytes read from the MIDI file at a time when streaming */
+#define STREAM_CHUNK 4096
 
 /* Thanks to http://subsynth.sourceforge.net/midinote2freq.html */
 static inline float key2hz(int key)
@@ -30,76 +34,1217 @@ static inline float key2hz(int key)
     return a * pow(2.0f, ((float)(key - 9) / 12));
 }
 
+/* SNG parameters of a GM instrument family at full volume */
+typedef struct
+{
+    uint8_t attack, decay, sustain, release;
+    uint8_t volume;
+    uint8_t wave;
+
+} family_env_t;
+
+static const family_env_t family_env[CHIP16_ENV_FAMILIES] = {
+    /* Piano */         { 0, 6,  4, 3, 15, CHIP16_WAVE_TRIANGLE },
+    /* Chrom. perc. */  { 0, 5,  0, 4, 14, CHIP16_WAVE_TRIANGLE },
+    /* Organ */         { 1, 0, 15, 1, 12, CHIP16_WAVE_PULSE },
+    /* Guitar */        { 0, 6,  3, 3, 13, CHIP16_WAVE_SAWTOOTH },
+    /* Bass */          { 0, 4, 10, 1, 15, CHIP16_WAVE_TRIANGLE },
+    /* Strings */       { 4, 4, 12, 5, 12, CHIP16_WAVE_SAWTOOTH },
+    /* Ensemble */      { 5, 4, 12, 6, 11, CHIP16_WAVE_SAWTOOTH },
+    /* Brass */         { 2, 4, 11, 3, 13, CHIP16_WAVE_PULSE },
+    /* Reed */          { 2, 3, 12, 2, 12, CHIP16_WAVE_PULSE },
+    /* Pipe */          { 3, 2, 13, 3, 11, CHIP16_WAVE_TRIANGLE },
+    /* Synth lead */    { 0, 3, 12, 2, 13, CHIP16_WAVE_PULSE },
+    /* Synth pad */     { 7, 6, 12, 8, 10, CHIP16_WAVE_SAWTOOTH },
+    /* Synth effects */ { 4, 7,  8, 7, 10, CHIP16_WAVE_SAWTOOTH },
+    /* Ethnic */        { 0, 5,  6, 4, 13, CHIP16_WAVE_SAWTOOTH },
+    /* Percussive */    { 0, 3,  0, 2, 15, CHIP16_WAVE_TRIANGLE },
+    /* Sound effects */ { 0, 5,  4, 5, 12, CHIP16_WAVE_NOISE }
+};
+
+/* Drum sounds */
+enum
+{
+    DRUM_KICK,
+    DRUM_SNARE,
+    DRUM_CLAP,
+    DRUM_HAT_CLOSED,
+    DRUM_HAT_OPEN,
+    DRUM_CRASH,
+    DRUM_RIDE,
+    DRUM_TOM_LOW,
+    DRUM_TOM_MID,
+    DRUM_TOM_HIGH,
+    DRUM_RIM,
+    DRUM_PERC
+};
+
+typedef struct
+{
+    uint16_t hz;
+    /* Length in ms */
+    uint16_t len;
+    family_env_t env;
+
+} drum_t;
+
+static const drum_t drums[CHIP16_NUM_DRUMS] = {
+    /* Kick */          {   60,  60, { 0, 2, 0, 1, 15, CHIP16_WAVE_TRIANGLE } },
+    /* Snare */         {  200,  80, { 0, 3, 0, 2, 13, CHIP16_WAVE_NOISE } },
+    /* Clap */          {  400,  60, { 0, 2, 0, 2, 12, CHIP16_WAVE_NOISE } },
+    /* Closed hi-hat */ { 1000,  30, { 0, 1, 0, 0,  9, CHIP16_WAVE_NOISE } },
+    /* Open hi-hat */   { 1000, 150, { 0, 4, 0, 3,  9, CHIP16_WAVE_NOISE } },
+    /* Crash */         {  800, 300, { 0, 6, 0, 5, 11, CHIP16_WAVE_NOISE } },
+    /* Ride */          { 1200, 150, { 0, 4, 0, 3,  9, CHIP16_WAVE_NOISE } },
+    /* Low tom */       {  100, 100, { 0, 3, 0, 2, 14, CHIP16_WAVE_TRIANGLE } },
+    /* Mid tom */       {  150, 100, { 0, 3, 0, 2, 14, CHIP16_WAVE_TRIANGLE } },
+    /* High tom */      {  200, 100, { 0, 3, 0, 2, 14, CHIP16_WAVE_TRIANGLE } },
+    /* Rim/sticks */    { 1000,  20, { 0, 0, 0, 0, 11, CHIP16_WAVE_PULSE } },
+    /* Cowbell/other */ {  560,  50, { 0, 2, 0, 1, 11, CHIP16_WAVE_PULSE } }
+};
+
+/* Drum sound of each GM percussion key, from 35 (Acoustic Bass Drum) to
+ * 81 (Open Triangle) */
+#define DRUM_KEY_FIRST 35
+#define DRUM_KEY_LAST  81
+
+static const uint8_t drum_keys[DRUM_KEY_LAST - DRUM_KEY_FIRST + 1] = {
+    DRUM_KICK, DRUM_KICK, DRUM_RIM, DRUM_SNARE, DRUM_CLAP, DRUM_SNARE,
+    DRUM_TOM_LOW, DRUM_HAT_CLOSED, DRUM_TOM_LOW, DRUM_HAT_CLOSED,
+    DRUM_TOM_MID, DRUM_HAT_OPEN, DRUM_TOM_MID, DRUM_TOM_HIGH, DRUM_CRASH,
+    DRUM_TOM_HIGH, DRUM_RIDE, DRUM_CRASH, DRUM_PERC, DRUM_HAT_OPEN,
+    DRUM_CRASH, DRUM_PERC, DRUM_CRASH, DRUM_HAT_OPEN, DRUM_RIDE,
+    DRUM_TOM_HIGH, DRUM_TOM_MID, DRUM_TOM_HIGH, DRUM_TOM_HIGH, DRUM_TOM_MID,
+    DRUM_TOM_HIGH, DRUM_TOM_MID, DRUM_PERC, DRUM_PERC, DRUM_HAT_CLOSED,
+    DRUM_HAT_CLOSED, DRUM_PERC, DRUM_PERC, DRUM_HAT_CLOSED, DRUM_HAT_OPEN,
+    DRUM_RIM, DRUM_RIM, DRUM_PERC, DRUM_TOM_HIGH, DRUM_TOM_HIGH, DRUM_PERC,
+    DRUM_PERC
+};
+
+/* Drum sound + 1 for a NOTE ON, or 0 if it is not a drum hit */
+static uint8_t drum_of_note(const chip16_xform_t *xf, uint8_t channel,
+                            uint8_t key)
+{
+    if(!xf->drums || channel != CHIP16_DRUM_CHANNEL)
+        return 0;
+    if(key < DRUM_KEY_FIRST || key > DRUM_KEY_LAST)
+        return DRUM_PERC + 1;
+    return drum_keys[key - DRUM_KEY_FIRST] + 1;
+}
+
+int chip16_envelope_index(uint8_t patch, uint8_t vel)
+{
+    int family = (patch & 0x7F) >> 3;
+    int vol = (family_env[family].volume * (vel & 0x7F) + 126) / 127;
+
+    return family * CHIP16_ENV_VOLUMES + (vol ? vol : 1);
+}
+
+int chip16_envelope(int index, uint16_t *ad, uint16_t *vtsr)
+{
+    const family_env_t *f;
+    int vol;
+
+    if(index < 0 || index >= CHIP16_ENV_TABLE_SIZE)
+        return 0;
+    if(index >= CHIP16_NUM_ENVELOPES) {
+        f = &drums[index - CHIP16_NUM_ENVELOPES].env;
+        vol = f->volume;
+    } else {
+        f = &family_env[index / CHIP16_ENV_VOLUMES];
+        vol = index % CHIP16_ENV_VOLUMES;
+    }
+    *ad = f->attack << 4 | f->decay;
+    *vtsr = vol << 12 | f->wave << 8 | f->sustain << 4 | f->release;
+
+    return 1;
+}
+
+int chip16_write_envelopes(const char *fn_env)
+{
+    FILE *f;
+    uint16_t entry[CHIP16_ENV_WORDS];
+    int i;
+
+    if((f = fopen(fn_env, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_env);
+        return -2;
+    }
+    for(i = 0; i < CHIP16_ENV_TABLE_SIZE; i++) {
+        chip16_envelope(i, &entry[0], &entry[1]);
+        fwrite(entry, sizeof(uint16_t), CHIP16_ENV_WORDS, f);
+    }
+    fclose(f);
+
+    return 1;
+}
+
+/* Time in ms of a number of pulses, at the current tempo and speed */
+static inline uint32_t to_ms(chip16_conv_t *c, uint32_t pulses)
+{
+    return (uint64_t)(pulses * c->mspp / 16) * 100 / c->xform.tempo;
+}
+
+/* Pulses lasting at least ms, at the current tempo and speed */
+static uint32_t to_pulses(chip16_conv_t *c, uint32_t ms)
+{
+    uint64_t div = (uint64_t) 100 * c->mspp;
+
+    return div ? ((uint64_t) ms * c->xform.tempo * 16 + div - 1) / div : ms;
+}
+
+/* Whether a NOTE ON passes the filters */
+static int keep_note(const chip16_xform_t *xf, uint8_t channel, uint8_t key,
+                     uint8_t vel)
+{
+    int k = key + xf->transpose;
+
+    return vel >= xf->min_vel && (xf->channels >> channel & 1) &&
+           key >= xf->key_lo && key <= xf->key_hi && k >= 0 && k < NUM_NOTES;
+}
+
+void chip16_xform_init(chip16_xform_t *xf)
+{
+    memset(xf, 0, sizeof(*xf));
+    xf->tempo = 100;
+    xf->channels = 0xFFFF;
+    xf->key_hi = NUM_NOTES - 1;
+}
+
+/* Longest delay before a packet, in ms */
+#define MAX_DELAY 1000
+
+/* Point markers up to tick (all of them if final) at the next packet */
+static void resolve_markers(chip16_conv_t *c, uint32_t tick, int final)
+{
+    chip16_marker_t *m;
+    uint32_t delay;
+
+    for(; c->next_marker < c->num_markers; c->next_marker++) {
+        m = &c->markers[c->next_marker];
+        if(!final && m->tick > tick)
+            break;
+        m->packet = c->total;
+        /* Part of the packet's delay, so clamped the same way */
+        delay = final ? 0 : to_ms(c, tick - m->tick);
+        m->delay = delay < MAX_DELAY ? delay : MAX_DELAY;
+        m->hz = m->dur = m->adsr = 0;
+        /* The last note written started before the marker */
+        if(c->total && c->last_note_end > m->tick) {
+            m->hz = c->last_hz;
+            m->dur = to_ms(c, c->last_note_end - m->tick);
+            m->adsr = c->last_adsr;
+        }
+    }
+}
+
+static void write_note(chip16_conv_t *c, chip16_note_t *n)
+{
+    int16_t packet[CHIP16_PACKET_WORDS];
+    const drum_t *d;
+    uint32_t delay, dur;
+
+    resolve_markers(c, n->start, 0);
+    delay = to_ms(c, n->start - c->last_note_start);
+    if(delay > MAX_DELAY) {
+        printf("warning: event %d: NOTE ON abnormal delay: %d pulses (%d ms)\n",
+               n->event, n->start - c->last_note_start, delay);
+        delay = MAX_DELAY;
+    }
+
+    dur = to_ms(c, n->end - n->start);
+    if(n->drum && dur > drums[n->drum - 1].len)
+        dur = drums[n->drum - 1].len;
+    if(c->xform.max_len && dur > c->xform.max_len)
+        dur = c->xform.max_len;
+    if(dur < c->xform.min_len)
+        dur = c->xform.min_len;
+
+    packet[0] = delay;
+    packet[1] = key2hz(n->key + c->xform.transpose);
+    packet[2] = dur;
+    packet[3] = c->xform.env_index ?
+                chip16_envelope_index(n->patch, n->vel) : 0x0432;
+    if(n->drum) {
+        d = &drums[n->drum - 1];
+        packet[1] = d->hz;
+        packet[3] = c->xform.env_index ?
+                    CHIP16_NUM_ENVELOPES + n->drum - 1 :
+                    d->env.attack << 12 | d->env.decay << 8 |
+                    d->env.sustain << 4 | d->env.release;
+    }
+    c->last_note_start = n->start;
+    c->last_note_end = n->end;
+    c->last_hz = packet[1];
+    c->last_adsr = packet[3];
+    c->sink(c->ctx, packet);
+    c->total += 1;
+}
+
+/* Make room for cap notes in the queue, keeping those in memory */
+static void grow_notes(chip16_conv_t *c, uint32_t cap)
+{
+    chip16_note_t *notes;
+    uint32_t seq;
+    size_t bytes = (size_t)(c->cap + cap) * sizeof(chip16_note_t);
+
+    notes = malloc(cap * sizeof(chip16_note_t));
+    for(seq = c->head; seq != c->tail - c->spilled; seq++)
+        notes[seq % cap] = c->notes[seq % c->cap];
+    free(c->notes);
+    c->notes = notes;
+    c->cap = cap;
+    /* Both arrays were there while copying */
+    if(bytes > c->notes_peak)
+        c->notes_peak = bytes;
+}
+
+/* Whether the pending note seq is in the spill file or its buffer */
+static int note_spilled(chip16_conv_t *c, uint32_t seq)
+{
+    return seq - c->head >= c->tail - c->head - c->spilled;
+}
+
+/* Last access to the spill file */
+#define SPILL_READ  1
+#define SPILL_WRITE 2
+
+/* Move the spill file to seq for reading or writing; stdio needs a seek
+ * between the two, otherwise only jumps do */
+static int spill_seek(chip16_conv_t *c, uint32_t seq, int mode)
+{
+    if(c->spill_error)
+        return -1;
+    if(c->spill_mode == mode && c->spill_at == seq)
+        return 0;
+    if(fseek(c->spill, (long)(seq - c->spill_base) * sizeof(chip16_note_t),
+             SEEK_SET)) {
+        c->spill_error = 1;
+        return -1;
+    }
+    c->spill_at = seq;
+    c->spill_mode = mode;
+    return 0;
+}
+
+static void spill_write(chip16_conv_t *c, uint32_t seq, const chip16_note_t *n,
+                        uint32_t num)
+{
+    if(spill_seek(c, seq, SPILL_WRITE) < 0)
+        return;
+    if(fwrite(n, sizeof(chip16_note_t), num, c->spill) != num)
+        c->spill_error = 1;
+    c->spill_at += num;
+}
+
+static void spill_read(chip16_conv_t *c, uint32_t seq, chip16_note_t *n)
+{
+    if(spill_seek(c, seq, SPILL_READ) < 0)
+        return;
+    if(fread(n, sizeof(chip16_note_t), 1, c->spill) != 1)
+        c->spill_error = 1;
+    c->spill_at++;
+}
+
+/* Append the buffered spilled notes to the file */
+static void flush_spill(chip16_conv_t *c)
+{
+    spill_write(c, c->tail - c->spill_buffered, c->spill_buf,
+                c->spill_buffered);
+    c->spill_buffered = 0;
+}
+
+/* Read spilled notes back into the empty queue, from the file then from
+ * its buffer */
+static void unspill_notes(chip16_conv_t *c)
+{
+    uint32_t seq, num, on_file;
+
+    num = c->spilled < c->cap ? c->spilled : c->cap;
+    on_file = c->spilled - c->spill_buffered;
+    for(seq = c->head; seq != c->head + num && seq - c->head < on_file; seq++)
+        spill_read(c, seq, &c->notes[seq % c->cap]);
+    if(num > on_file) {
+        for(; seq != c->head + num; seq++)
+            c->notes[seq % c->cap] = c->spill_buf[seq - c->head - on_file];
+        c->spill_buffered -= num - on_file;
+        memmove(c->spill_buf, c->spill_buf + (num - on_file),
+                c->spill_buffered * sizeof(chip16_note_t));
+    }
+    c->spilled -= num;
+}
+
+/* Write every finished note at the front of the queue */
+static void flush_notes(chip16_conv_t *c)
+{
+    chip16_note_t *n;
+
+    while(c->head != c->tail && !c->spill_error) {
+        if(c->head == c->tail - c->spilled)
+            unspill_notes(c);
+        if(c->spill_error)
+            break;
+        n = &c->notes[c->head % c->cap];
+        if(n->open)
+            break;
+        /* Nothing left of a split note if it ended right after the split */
+        if(!n->split || to_ms(c, n->end - n->start))
+            write_note(c, n);
+        c->head++;
+    }
+}
+
+/* Swap two queued notes, keeping track of the sounding ones */
+static void swap_notes(chip16_conv_t *c, uint32_t a, uint32_t b)
+{
+    chip16_note_t tmp, *na = &c->notes[a % c->cap], *nb = &c->notes[b % c->cap];
+
+    tmp = *na, *na = *nb, *nb = tmp;
+    if(na->open)
+        c->sounding[na->channel][na->key] = a + 1;
+    if(nb->open)
+        c->sounding[nb->channel][nb->key] = b + 1;
+}
+
+/* Write the part of held notes older than max_hold, keeping the rest */
+static void split_held_notes(chip16_conv_t *c)
+{
+    chip16_note_t *n, part;
+    uint32_t seq;
+
+    while(c->max_hold && c->head != c->tail) {
+        n = &c->notes[c->head % c->cap];
+        if(c->clock - n->start < c->max_hold)
+            break;
+        part = *n;
+        part.end = n->start + c->max_hold;
+        write_note(c, &part);
+        n->start = part.end;
+        n->split = 1;
+        /* Move the rest of the note back into start order */
+        for(seq = c->head; seq + 1 != c->tail; seq++) {
+            if(c->notes[(seq + 1) % c->cap].start > c->notes[seq % c->cap].start)
+                break;
+            swap_notes(c, seq, seq + 1);
+        }
+        flush_notes(c);
+    }
+}
+
+/* Queue a note, in memory or in the spill file once max_notes are used */
+static void push_note(chip16_conv_t *c, const chip16_note_t *n)
+{
+    int spilling = c->spill != NULL && !c->max_hold;
+    uint32_t cap;
+
+    if(c->tail - c->head == c->cap && !c->spilled) {
+        cap = c->cap ? c->cap * 2 : 16;
+        if(spilling && c->cap + cap > c->max_notes)
+            cap = c->max_notes - c->cap;
+        if(cap > c->cap)
+            grow_notes(c, cap);
+    }
+    if(spilling && (c->spilled || c->tail - c->head == c->cap)) {
+        /* The file is reused from its start */
+        if(!c->spilled) {
+            c->spill_base = c->tail;
+            c->spill_mode = 0;
+        }
+        c->spill_buf[c->spill_buffered++] = *n;
+        c->spilled++;
+        c->total_spilled++;
+        c->tail++;
+        if(c->spill_buffered == CHIP16_SPILL_BATCH)
+            flush_spill(c);
+        return;
+    }
+    c->notes[c->tail++ % c->cap] = *n;
+}
+
+static void end_note(chip16_conv_t *c, uint8_t channel, uint8_t key)
+{
+    uint32_t seq = c->sounding[channel][key];
+    chip16_note_t n;
+
+    if(!seq)
+        return;
+    seq--;
+    if(!note_spilled(c, seq)) {
+        c->notes[seq % c->cap].end = c->clock;
+        c->notes[seq % c->cap].open = 0;
+    } else if(c->tail - seq <= c->spill_buffered) {
+        n = c->spill_buf[c->spill_buffered - (c->tail - seq)];
+        n.end = c->clock;
+        n.open = 0;
+        c->spill_buf[c->spill_buffered - (c->tail - seq)] = n;
+    } else {
+        /* Updated in place */
+        spill_read(c, seq, &n);
+        n.end = c->clock;
+        n.open = 0;
+        spill_write(c, seq, &n, 1);
+    }
+    c->sounding[channel][key] = 0;
+    flush_notes(c);
+}
+
+/* Priority of a held note under the voice reduction policy; of two notes
+ * otherwise equal, the later one wins */
+static uint64_t held_prio(chip16_conv_t *c, uint8_t channel, uint8_t key)
+{
+    uint32_t major;
+
+    switch(c->xform.voice) {
+    case CHIP16_VOICE_HIGHEST:
+        major = key;
+        break;
+    case CHIP16_VOICE_LOWEST:
+        major = NUM_NOTES - 1 - key;
+        break;
+    case CHIP16_VOICE_CHANNEL:
+        major = c->xform.chan_rank[channel];
+        break;
+    default:
+        major = 0;
+        break;
+    }
+
+    return (uint64_t) major << 32 | (uint32_t) c->num_events;
+}
+
+static void set_held(chip16_conv_t *c, int i, const chip16_held_t *h)
+{
+    c->held[i] = *h;
+    c->sounding[h->channel][h->key] = i + 1;
+}
+
+static void sift_up(chip16_conv_t *c, int i)
+{
+    chip16_held_t h = c->held[i];
+
+    for(; i > 0 && c->held[(i - 1) / 2].prio < h.prio; i = (i - 1) / 2)
+        set_held(c, i, &c->held[(i - 1) / 2]);
+    set_held(c, i, &h);
+}
+
+static void sift_down(chip16_conv_t *c, int i)
+{
+    chip16_held_t h = c->held[i];
+    int child;
+
+    for(; (child = 2 * i + 1) < c->num_held; i = child) {
+        if(child + 1 < c->num_held &&
+           c->held[child + 1].prio > c->held[child].prio)
+            child++;
+        if(c->held[child].prio <= h.prio)
+            break;
+        set_held(c, i, &c->held[child]);
+    }
+    set_held(c, i, &h);
+}
+
+static void release_held(chip16_conv_t *c, uint8_t channel, uint8_t key)
+{
+    int i = c->sounding[channel][key] - 1;
+
+    c->sounding[channel][key] = 0;
+    if(i == --c->num_held)
+        return;
+    set_held(c, i, &c->held[c->num_held]);
+    sift_up(c, i);
+    sift_down(c, c->sounding[c->held[i].channel][c->held[i].key] - 1);
+}
+
+/* Play the top held note, ending the one played so far if it changed */
+static void play_top(chip16_conv_t *c)
+{
+    chip16_held_t *top = c->num_held ? &c->held[0] : NULL;
+    chip16_note_t *n = &c->playing;
+
+    if(c->drum_on)
+        top = &c->drum_hit;
+    if(n->open && top != NULL && top->event == n->event)
+        return;
+    if(n->open) {
+        n->end = c->clock;
+        n->open = 0;
+        /* Notes at once, as in a chord, leave only the last on top */
+        if(n->end > n->start)
+            write_note(c, n);
+    }
+    if(top != NULL) {
+        n->start = n->end = c->clock;
+        n->event = top->event;
+        n->key = top->key;
+        n->vel = top->vel;
+        n->channel = top->channel;
+        n->patch = top->patch;
+        n->drum = top->drum;
+        n->open = 1;
+        n->split = 0;
+    }
+}
+
+/* Update the held notes with an event, when reducing voices */
+static void hold_event(chip16_conv_t *c, const midi_event_t *e)
+{
+    chip16_held_t h;
+    uint8_t key = e->params[0] & 0x7F;
+
+    if((e->status & 0xF0) != MIDI_CMD_NOTE_ON &&
+       (e->status & 0xF0) != MIDI_CMD_NOTE_OFF)
+        return;
+    if(c->sounding[e->channel][key])
+        release_held(c, e->channel, key);
+    if((e->status & 0xF0) == MIDI_CMD_NOTE_ON && e->params[1] &&
+       keep_note(&c->xform, e->channel, key, e->params[1])) {
+        h.prio = held_prio(c, e->channel, key);
+        h.event = c->num_events;
+        h.key = key;
+        h.vel = e->params[1];
+        h.channel = e->channel;
+        h.patch = c->patch[e->channel];
+        h.drum = drum_of_note(&c->xform, e->channel, key);
+        if(h.drum) {
+            /* The last hit cuts the one before */
+            c->drum_hit = h;
+            c->drum_until = c->clock + to_pulses(c, drums[h.drum - 1].len);
+            c->drum_on = 1;
+        } else {
+            if(c->held == NULL)
+                c->held = malloc(NUM_CHANNELS * NUM_NOTES *
+                                 sizeof(chip16_held_t));
+            c->held[c->num_held] = h;
+            sift_up(c, c->num_held++);
+        }
+    }
+    play_top(c);
+}
+
+/* Write the part of the played note older than max_hold */
+static void split_playing(chip16_conv_t *c)
+{
+    chip16_note_t part;
+
+    while(c->playing.open && c->clock - c->playing.start >= c->max_hold) {
+        part = c->playing;
+        part.end = part.start + c->max_hold;
+        write_note(c, &part);
+        c->playing.start = part.end;
+    }
+}
+
+void chip16_conv_init(chip16_conv_t *c, uint32_t mspp,
+                      chip16_sink_fn sink, void *ctx)
+{
+    memset(c, 0, sizeof(*c));
+    chip16_xform_init(&c->xform);
+    c->mspp = mspp;
+    c->sink = sink;
+    c->ctx = ctx;
+}
+
+void chip16_conv_event(chip16_conv_t *c, const midi_event_t *e)
+{
+    chip16_note_t n;
+    uint8_t key = e->params[0] & 0x7F;
+
+    chip16_conv_advance(c, e->dt);
+    if((e->status & 0xF0) == MIDI_CMD_PATCH_CHG)
+        c->patch[e->channel] = e->params[0] & 0x7F;
+    if(c->xform.voice != CHIP16_VOICE_ALL) {
+        hold_event(c, e);
+        c->num_events++;
+        return;
+    }
+    switch(e->status & 0xF0) {
+    case MIDI_CMD_NOTE_ON:
+        /* A NOTE ON with zero velocity is a NOTE OFF */
+        end_note(c, e->channel, key);
+        if(!e->params[1] ||
+           !keep_note(&c->xform, e->channel, key, e->params[1]))
+            break;
+        n.start = c->clock;
+        n.end = c->clock;
+        n.event = c->num_events;
+        n.key = key;
+        n.vel = e->params[1];
+        n.channel = e->channel;
+        n.patch = c->patch[e->channel];
+        n.split = 0;
+        n.drum = drum_of_note(&c->xform, e->channel, key);
+        n.open = !n.drum;
+        /* A drum hit is over as soon as it starts */
+        if(n.drum)
+            n.end = c->clock + to_pulses(c, drums[n.drum - 1].len);
+        push_note(c, &n);
+        if(n.drum)
+            flush_notes(c);
+        else
+            c->sounding[e->channel][key] = c->tail;
+        break;
+    case MIDI_CMD_NOTE_OFF:
+        end_note(c, e->channel, key);
+        break;
+    }
+    c->num_events++;
+}
+
+/* Insert m after the markers at or before its time */
+static void insert_marker(chip16_marker_t **markers, int *num, int *cap,
+                          int first, const chip16_marker_t *m)
+{
+    int i;
+
+    if(*num == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *markers = realloc(*markers, *cap * sizeof(chip16_marker_t));
+    }
+    for(i = *num; i > first && (*markers)[i - 1].tick > m->tick; i--)
+        (*markers)[i] = (*markers)[i - 1];
+    (*markers)[i] = *m;
+    (*num)++;
+}
+
+void chip16_conv_marker(chip16_conv_t *c, const chip16_marker_t *m)
+{
+    if(c->max_markers && c->num_markers >= c->max_markers) {
+        c->dropped_markers++;
+        return;
+    }
+    insert_marker(&c->markers, &c->num_markers, &c->cap_markers,
+                  c->next_marker, m);
+}
+
+void chip16_conv_advance(chip16_conv_t *c, uint32_t dt)
+{
+    /* A drum hit over held notes ends by itself */
+    if(c->drum_on && c->clock + dt >= c->drum_until) {
+        dt -= c->drum_until - c->clock;
+        c->clock = c->drum_until;
+        c->drum_on = 0;
+        play_top(c);
+    }
+    c->clock += dt;
+    if(c->max_hold && c->xform.voice != CHIP16_VOICE_ALL)
+        split_playing(c);
+    else if(c->max_hold)
+        split_held_notes(c);
+}
+
+void chip16_conv_finish(chip16_conv_t *c)
+{
+    int ch, key;
+
+    /* Notes never released last until the end of the track; every
+     * sounding note has its entry, spilled or not */
+    if(c->xform.voice == CHIP16_VOICE_ALL) {
+        for(ch = 0; ch < NUM_CHANNELS; ch++) {
+            for(key = 0; key < NUM_NOTES; key++)
+                end_note(c, ch, key);
+        }
+    }
+    flush_notes(c);
+    c->num_held = 0;
+    c->drum_on = 0;
+    play_top(c);
+    /* Markers after the last note point past the end */
+    resolve_markers(c, c->clock, 1);
+    free(c->notes);
+    free(c->held);
+    c->notes = NULL;
+    c->held = NULL;
+    c->head = c->tail = c->cap = c->spilled = c->spill_buffered = 0;
+    memset(c->sounding, 0, sizeof(c->sounding));
+}
+
+void chip16_conv_free(chip16_conv_t *c)
+{
+    free(c->markers);
+    c->markers = NULL;
+    c->num_markers = c->cap_markers = c->next_marker = 0;
+}
+
+int chip16_marker_from_event(chip16_marker_t *m, const midi_event_t *e,
+                             uint32_t tick)
+{
+    char key[CHIP16_MARKER_NAME];
+    int i, j, len;
+
+    if(e->status != MIDI_CMD_SYS_RESET ||
+       (e->meta != MIDI_META_MARKER && e->meta != MIDI_META_CUE_PT))
+        return 0;
+
+    memset(m, 0, sizeof(*m));
+    m->tick = tick;
+    len = e->param_len < CHIP16_MARKER_NAME - 1 ?
+          e->param_len : CHIP16_MARKER_NAME - 1;
+    memcpy(m->name, e->params, len);
+    if(e->meta == MIDI_META_CUE_PT)
+        m->flags |= CHIP16_SEEK_CUE;
+
+    /* Loop points: "loopStart", "Loop start", "LOOP_END"... */
+    for(i = j = 0; i < len; i++) {
+        if(isalpha((unsigned char) m->name[i]))
+            key[j++] = tolower((unsigned char) m->name[i]);
+    }
+    key[j] = '\0';
+    if(!strcmp(key, "loopstart"))
+        m->flags |= CHIP16_SEEK_LOOP_START;
+    else if(!strcmp(key, "loopend"))
+        m->flags |= CHIP16_SEEK_LOOP_END;
+
+    return 1;
+}
+
+int chip16_find_markers(midi_track_t *tracks, int num_tracks,
+                        chip16_marker_t **markers)
+{
+    chip16_marker_t m;
+    midi_event_t *e;
+    uint32_t clock;
+    int t, num, cap;
+
+    *markers = NULL;
+    num = cap = 0;
+    for(t = 0; t < num_tracks; t++) {
+        clock = 0;
+        for(e = tracks[t].events; e != NULL; e = e->next) {
+            clock += e->dt;
+            if(chip16_marker_from_event(&m, e, clock))
+                insert_marker(markers, &num, &cap, 0, &m);
+        }
+    }
+
+    return num;
+}
+
+int chip16_write_seek(const char *fn_seek, chip16_conv_t *c)
+{
+    FILE *fseek_tbl;
+    chip16_marker_t *m;
+    int16_t hdr[3], words[CHIP16_SEEK_WORDS - CHIP16_MARKER_NAME / 2];
+    int i;
+
+    if((fseek_tbl = fopen(fn_seek, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_seek);
+        return -2;
+    }
+
+    /* Number of entries, then the loop start and end entries or -1 */
+    hdr[0] = c->num_markers;
+    hdr[1] = hdr[2] = -1;
+    for(i = 0; i < c->num_markers; i++) {
+        if(hdr[1] < 0 && (c->markers[i].flags & CHIP16_SEEK_LOOP_START))
+            hdr[1] = i;
+        if(hdr[2] < 0 && (c->markers[i].flags & CHIP16_SEEK_LOOP_END))
+            hdr[2] = i;
+    }
+    fwrite(hdr, sizeof(int16_t), 3, fseek_tbl);
+
+    for(i = 0; i < c->num_markers; i++) {
+        m = &c->markers[i];
+        words[0] = m->flags;
+        words[1] = m->packet;
+        words[2] = m->delay;
+        words[3] = m->hz;
+        words[4] = m->dur;
+        words[5] = m->adsr;
+        fwrite(words, sizeof(int16_t), CHIP16_SEEK_WORDS - CHIP16_MARKER_NAME / 2,
+               fseek_tbl);
+        fwrite(m->name, 1, CHIP16_MARKER_NAME, fseek_tbl);
+    }
+    printf("%d markers, ", c->num_markers);
+    fclose(fseek_tbl);
+
+    return 1;
+}
+
+void chip16_file_sink(void *ctx, const int16_t *packet)
+{
+    fwrite(packet, sizeof(int16_t), CHIP16_PACKET_WORDS, (FILE *) ctx);
+}
+
+void chip16_packets_sink(void *ctx, const int16_t *packet)
+{
+    chip16_packets_t *p = ctx;
+
+    if(p->num == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 256;
+        p->packets = realloc(p->packets,
+                             p->cap * CHIP16_PACKET_WORDS * sizeof(int16_t));
+    }
+    memcpy(p->packets + p->num * CHIP16_PACKET_WORDS, packet,
+           CHIP16_PACKET_WORDS * sizeof(int16_t));
+    p->num++;
+}
+
+/* Follow a tempo change, as every mode must for the same packets */
+static void set_tempo(chip16_conv_t *c, const midi_event_t *e, uint32_t ppqn)
+{
+    if(e->status == MIDI_CMD_SYS_RESET && e->meta == MIDI_META_TEMPO &&
+       e->param_len >= 3)
+        c->mspp = midi_pulse_len(e->params[0] << 16 | e->params[1] << 8 |
+                                 e->params[2], ppqn);
+}
+
 int chip16_write_track(const char *fn_asm, const char *fn_notes,
-                       midi_track_t *track)
+                       midi_track_t *track, uint32_t ppqn,
+                       chip16_opts_t *opts)
 {
-    const char *fn_notes_alt = "mus_menu.bin";
-    FILE *fnotes_alt;
+    FILE *fnotes;
+    chip16_conv_t conv;
     midi_event_t *evt;
-    int16_t packet[4];
-    /* Milliseconds per pulse */
-    uint32_t mspp;
-    /* For each key/note, record the start time */
-    int note_start[NUM_NOTES] = {0};
-    int note_end[NUM_NOTES] = {0};
-    int i, total, clock, last_note_start;
-    
+    int i;
+
     /* Write the notes to a separate file */
-    if((fnotes_alt = fopen(fn_notes_alt, "wb")) == NULL) {
-        printf("error: could not open %s for writing\n", fn_notes_alt);
+    if((fnotes = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
         return -2;
     }
-  
-    memset(note_start, 0, NUM_NOTES * sizeof(int));
 
-    mspp = track->pulse_len;
-    printf("using %d ms per pulse\n", mspp); 
+    /* Default tempo of 120 bpm until told otherwise */
+    chip16_conv_init(&conv, midi_pulse_len(500000, ppqn), chip16_file_sink,
+                     fnotes);
+    printf("using %d ms per pulse\n", conv.mspp);
+    conv.xform = opts->xform;
+    for(i = 0; i < opts->num_markers; i++)
+        chip16_conv_marker(&conv, &opts->markers[i]);
     evt = track->events;
-    total = 0;
-    clock = 0;
-    last_note_start = 0;
-
     for(i = 0; i < track->num_events; i++) {
-        clock += evt->dt;
-        /* Find the next key press (on). */
-        if((evt->status & 0xF0) == MIDI_CMD_NOTE_ON && evt->params[1]) {
-            int16_t dur;
-            int16_t delay;
-            int t_start = clock;
-            int t_end = clock;
-
-            midi_event_t *e = evt->next;
-            /* Find the corresponding note end (off). */
-            while (e && (e->status & 0xF0) != MIDI_CMD_NOTE_OFF) {
-                t_end += e->dt;
-                e = e->next;
-            }
-            if (e) {
-                t_end += e->dt;
-            }
-
-            dur = (t_end - t_start) * mspp / 16;
-            delay = (t_start - last_note_start) * mspp / 16;
-            if (delay > 1000) {
-                printf("warning: event %d: NOTE ON abnormal delay: %d pulses (%d ms)\n",
-                       i, t_start - last_note_start, delay);
-                delay = 1000;
-            }
-
-            packet[0] = delay;
-            packet[1] = key2hz(evt->params[0]);
-            packet[2] = dur;
-            packet[3] = 0x0432;
-            fwrite(packet, sizeof(int16_t), 4, fnotes_alt);
-            total += 1;
-            last_note_start = t_start;
-        }
+        set_tempo(&conv, evt, ppqn);
+        chip16_conv_event(&conv, evt);
         evt = evt->next;
     }
+    chip16_conv_finish(&conv);
+
+    printf("wrote %d notes, ", conv.total);
+    fclose(fnotes);
+    i = opts->fn_seek != NULL ? chip16_write_seek(opts->fn_seek, &conv) : 1;
+    chip16_conv_free(&conv);
+
+    return i;
+}
+
+/* Done with a track when converting all of them; get ready for the next */
+static void end_track(chip16_file_conv_t *fc)
+{
+    chip16_conv_finish(&fc->conv);
+    chip16_conv_free(&fc->conv);
+    fc->total += fc->conv.total;
+    if(fc->track_end != NULL)
+        fc->track_end(fc->end_ctx, fc->cur_track);
+    chip16_conv_init(&fc->conv, 0, fc->sink, fc->ctx);
+    fc->conv.xform = fc->opts->xform;
+    fc->started = 0;
+}
+
+void chip16_file_conv_init(chip16_file_conv_t *fc, int track,
+                           chip16_opts_t *opts, chip16_sink_fn sink, void *ctx)
+{
+    memset(fc, 0, sizeof(*fc));
+    fc->opts = opts;
+    fc->sink = sink;
+    fc->ctx = ctx;
+    fc->track = track;
+    fc->cur_track = -1;
+    chip16_conv_init(&fc->conv, 0, sink, ctx);
+    fc->conv.xform = opts->xform;
+}
 
-    printf("wrote %d notes, ", total);
-    fclose(fnotes_alt);
+void chip16_file_conv_event(chip16_file_conv_t *fc, uint32_t ppqn, int track,
+                            midi_event_t *e)
+{
+    chip16_marker_t m;
+
+    if(track != fc->cur_track) {
+        if(fc->track == CHIP16_ALL_TRACKS && fc->started)
+            end_track(fc);
+        fc->cur_track = track;
+        fc->clock = 0;
+    }
+    fc->clock += e->dt;
+    /* Later tracks come after the notes they would point at */
+    if(fc->opts->fn_seek != NULL && fc->track != CHIP16_ALL_TRACKS &&
+       track <= fc->track && chip16_marker_from_event(&m, e, fc->clock))
+        chip16_conv_marker(&fc->conv, &m);
+
+    if(fc->track != CHIP16_ALL_TRACKS && track != fc->track)
+        return;
+    if(!fc->started) {
+        /* Default tempo of 120 bpm until told otherwise */
+        fc->conv.mspp = midi_pulse_len(500000, ppqn);
+        fc->started = 1;
+    }
+    set_tempo(&fc->conv, e, ppqn);
+    chip16_conv_event(&fc->conv, e);
+}
+
+int chip16_file_conv_finish(chip16_file_conv_t *fc)
+{
+    int ret;
+
+    if(fc->track == CHIP16_ALL_TRACKS) {
+        if(fc->started)
+            end_track(fc);
+    } else {
+        chip16_conv_finish(&fc->conv);
+        fc->total = fc->conv.total;
+        if(!fc->started)
+            printf("warning: track %d not found\n", fc->track);
+    }
+
+    printf("wrote %d notes, ", fc->total);
+    ret = fc->total;
+    if(fc->conv.spill_error) {
+        printf("error: could not spill notes to a temporary file, "
+               "output is incomplete\n");
+        ret = -1;
+    }
+    if(fc->opts->fn_seek != NULL && fc->track != CHIP16_ALL_TRACKS &&
+       chip16_write_seek(fc->opts->fn_seek, &fc->conv) < 0)
+        ret = -1;
+    chip16_conv_free(&fc->conv);
+
+    return ret;
+}
+
+typedef struct
+{
+    midi_stream_t stream;
+    chip16_file_conv_t fc;
+
+} stream_ctx_t;
+
+static void stream_event(void *ctx, int track, midi_event_t *e)
+{
+    stream_ctx_t *sc = ctx;
+
+    chip16_file_conv_event(&sc->fc, hdr_tdiv_le(&sc->stream.hdr), track, e);
+}
+
+/* Feed the whole file to the decoder and the converter behind it */
+static int convert_stream(FILE *fmid, stream_ctx_t *sc)
+{
+    uint8_t buf[STREAM_CHUNK];
+    size_t len;
+    int err, ret;
+
+    midi_stream_init(&sc->stream, stream_event, sc);
+    while((len = fread(buf, 1, sizeof(buf), fmid)) > 0) {
+        if(midi_stream_feed(&sc->stream, buf, len))
+            break;
+    }
+    err = midi_stream_finish(&sc->stream);
+    if(err)
+        printf("warning: MIDI stream error %d near byte %u\n",
+               err, sc->stream.offset);
+    ret = chip16_file_conv_finish(&sc->fc);
+
+    return err ? -1 : ret;
+}
+
+int chip16_convert_stream(FILE *fmid, int track, chip16_opts_t *opts,
+                          chip16_sink_fn sink, void *ctx)
+{
+    stream_ctx_t sc;
+
+    chip16_file_conv_init(&sc.fc, track, opts, sink, ctx);
+    return convert_stream(fmid, &sc);
+}
+
+typedef struct
+{
+    const char *fn_notes;
+    int interleave;
+    /* Packets of the current track */
+    chip16_packets_t cur;
+    /* Interleaving: every track with notes so far */
+    chip16_packets_t *voices;
+    int num_voices;
+    int err;
+
+} all_ctx_t;
+
+/* "dir/song.bin" -> "dir/song.<track>.bin" */
+static char* track_file_name(const char *fn_notes, int track)
+{
+    const char *dot = strrchr(fn_notes, '.');
+    const char *slash = strrchr(fn_notes, '/');
+    size_t base;
+    char *fn;
+
+    if(dot == NULL || (slash != NULL && dot < slash))
+        dot = fn_notes + strlen(fn_notes);
+    base = dot - fn_notes;
+    fn = malloc(strlen(fn_notes) + 16);
+    memcpy(fn, fn_notes, base);
+    sprintf(fn + base, ".%d%s", track, dot);
+
+    return fn;
+}
+
+/* Write the packets of a track to its own file, named after fn_notes */
+static int write_track_file(const char *fn_notes, int track,
+                            const chip16_packets_t *p)
+{
+    FILE *f;
+    char *fn;
+    int ret = 1;
+
+    fn = track_file_name(fn_notes, track);
+    if((f = fopen(fn, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn);
+        ret = -2;
+    } else {
+        fwrite(p->packets, sizeof(int16_t), p->num * CHIP16_PACKET_WORDS, f);
+        fclose(f);
+        printf("track %d to '%s', ", track, fn);
+    }
+    free(fn);
+
+    return ret;
+}
+
+static void all_track_end(void *ctx, int track)
+{
+    all_ctx_t *ac = ctx;
+    int ret;
+
+    if(!ac->cur.num)
+        return;
+
+    if(ac->interleave) {
+        printf("voice %d = track %d, ", ac->num_voices, track);
+        ac->voices = realloc(ac->voices, (ac->num_voices + 1) *
+                                         sizeof(chip16_packets_t));
+        ac->voices[ac->num_voices++] = ac->cur;
+        memset(&ac->cur, 0, sizeof(ac->cur));
+        return;
+    }
+
+    if((ret = write_track_file(ac->fn_notes, track, &ac->cur)) < 0)
+        ac->err = ret;
+    ac->cur.num = 0;
+}
+
+/* Merge the voices by start time, as a single player would see them */
+static int write_interleaved(const char *fn_notes,
+                             const chip16_packets_t *voices, int num_voices)
+{
+    FILE *f;
+    int16_t rec[CHIP16_VOICE_PACKET_WORDS], *p;
+    uint32_t *next_start, last_start;
+    int *pos, v, best;
+
+    if((f = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
+        return -2;
+    }
+    pos = calloc(num_voices, sizeof(int));
+    next_start = calloc(num_voices, sizeof(uint32_t));
+    for(v = 0; v < num_voices; v++)
+        next_start[v] = (uint16_t) voices[v].packets[0];
+    last_start = 0;
+
+    for(;;) {
+        best = -1;
+        for(v = 0; v < num_voices; v++) {
+            if(pos[v] < voices[v].num &&
+               (best < 0 || next_start[v] < next_start[best]))
+                best = v;
+        }
+        if(best < 0)
+            break;
+
+        p = voices[best].packets + pos[best] * CHIP16_PACKET_WORDS;
+        rec[0] = next_start[best] - last_start;
+        rec[1] = best;
+        rec[2] = p[1];
+        rec[3] = p[2];
+        rec[4] = p[3];
+        fwrite(rec, sizeof(int16_t), CHIP16_VOICE_PACKET_WORDS, f);
+        last_start = next_start[best];
+
+        if(++pos[best] < voices[best].num)
+            next_start[best] += (uint16_t) p[CHIP16_PACKET_WORDS];
+    }
+
+    free(pos);
+    free(next_start);
+    fclose(f);
 
     return 1;
 }
 
+int chip16_write_tracks(const char *fn_notes, const chip16_packets_t *tracks,
+                        int num_tracks, int interleave)
+{
+    chip16_packets_t *voices;
+    int t, num_voices, ret;
+
+    if(!interleave) {
+        for(t = 0, ret = 1; t < num_tracks; t++) {
+            if(tracks[t].num && write_track_file(fn_notes, t, &tracks[t]) < 0)
+                ret = -2;
+        }
+        return ret;
+    }
+
+    voices = malloc((num_tracks + 1) * sizeof(chip16_packets_t));
+    for(t = 0, num_voices = 0; t < num_tracks; t++) {
+        if(!tracks[t].num)
+            continue;
+        printf("voice %d = track %d, ", num_voices, t);
+        voices[num_voices++] = tracks[t];
+    }
+    ret = write_interleaved(fn_notes, voices, num_voices);
+    free(voices);
+
+    return ret;
+}
+
+int chip16_write_all(FILE *fmid, const char *fn_notes, chip16_opts_t *opts,
+                     int interleave)
+{
+    stream_ctx_t sc;
+    all_ctx_t ac;
+    int ret, v;
+
+    memset(&ac, 0, sizeof(ac));
+    ac.fn_notes = fn_notes;
+    ac.interleave = interleave;
+
+    chip16_file_conv_init(&sc.fc, CHIP16_ALL_TRACKS, opts,
+                          chip16_packets_sink, &ac.cur);
+    sc.fc.track_end = all_track_end;
+    sc.fc.end_ctx = &ac;
+    ret = convert_stream(fmid, &sc);
+    if(ret >= 0 && ac.err)
+        ret = ac.err;
+    if(ret >= 0 && interleave)
+        ret = write_interleaved(ac.fn_notes, ac.voices, ac.num_voices);
+
+    for(v = 0; v < ac.num_voices; v++)
+        free(ac.voices[v].packets);
+    free(ac.voices);
+    free(ac.cur.packets);
+
+    return ret < 0 ? ret : 1;
+}
+
+int chip16_write_stream(FILE *fmid, const char *fn_notes, int track,
+                        chip16_opts_t *opts)
+{
+    FILE *fnotes;
+    int ret;
+
+    if((fnotes = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
+        return -2;
+    }
+    ret = chip16_convert_stream(fmid, track, opts, chip16_file_sink, fnotes);
+    fclose(fnotes);
+
+    return ret < 0 ? -1 : 1;
+}
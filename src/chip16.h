@@ -22,11 +22,371 @@
  * Chip16 output functionality.
  */
 
+#include <stdio.h>
+
 #include "midi.h"
 
-/* Write a standard MIDI track straight to file in Chip16 assembly */
+#define NUM_NOTES 0x80
+#define NUM_CHANNELS 0x10
+
+/* Note packet words: delay since last note start, frequency, length, ADSR */
+#define CHIP16_PACKET_WORDS 4
+
+/* A note whose packet has not been written yet */
+typedef struct
+{
+    /* Start and end times, in pulses */
+    uint32_t start;
+    uint32_t end;
+    /* Index of the NOTE ON event in the track */
+    int event;
+    uint8_t key;
+    uint8_t vel;
+    uint8_t channel;
+    /* Patch of the channel when the note started */
+    uint8_t patch;
+    /* Drum sound + 1 for a percussion hit, or 0 */
+    uint8_t drum;
+    /* Still sounding, i.e. end unknown */
+    uint8_t open;
+    /* Continuation of a note already partly written */
+    uint8_t split;
+
+} chip16_note_t;
+
+/* Seek table entry words: flags, packet index, delay before that packet,
+ * then the note sounding at the marker (frequency, time left, ADSR) so
+ * that playback can resume from there, and the name */
+#define CHIP16_SEEK_WORDS 14
+#define CHIP16_MARKER_NAME 16
+
+/* Seek entry flags */
+#define CHIP16_SEEK_LOOP_START  0x0001
+#define CHIP16_SEEK_LOOP_END    0x0002
+#define CHIP16_SEEK_CUE         0x0004
+
+/* A marker or cue point, and its seek entry once resolved */
+typedef struct
+{
+    /* Time, in pulses */
+    uint32_t tick;
+    uint16_t flags;
+    char name[CHIP16_MARKER_NAME];
+    int16_t packet;
+    int16_t delay;
+    int16_t hz;
+    int16_t dur;
+    int16_t adsr;
+
+} chip16_marker_t;
+
+/*
+ * Envelope table.
+ *
+ * Instead of an ADSR word, packet[3] may hold an index into a fixed table
+ * of SNG parameters: one entry per General MIDI instrument family (8
+ * patches each) and volume level, the volume following the velocity.
+ * Entries are two words, as the SNG instruction takes them:
+ * attack << 4 | decay, then volume << 12 | waveform << 8 | sustain << 4 |
+ * release.
+ */
+#define CHIP16_ENV_FAMILIES     16
+#define CHIP16_ENV_VOLUMES      16
+#define CHIP16_NUM_ENVELOPES    (CHIP16_ENV_FAMILIES * CHIP16_ENV_VOLUMES)
+#define CHIP16_ENV_WORDS        2
+
+/* Drum sounds for General MIDI percussion keys (on MIDI channel 10, i.e.
+ * channel 9 here) follow the envelopes in the table, one entry each,
+ * at a fixed volume; their pitch and length are fixed too */
+#define CHIP16_DRUM_CHANNEL     9
+#define CHIP16_NUM_DRUMS        12
+#define CHIP16_ENV_TABLE_SIZE   (CHIP16_NUM_ENVELOPES + CHIP16_NUM_DRUMS)
+
+/* Chip16 waveforms */
+#define CHIP16_WAVE_TRIANGLE    0
+#define CHIP16_WAVE_SAWTOOTH    1
+#define CHIP16_WAVE_PULSE       2
+#define CHIP16_WAVE_NOISE       3
+
+/* Table index for a note of the given patch and velocity */
+int chip16_envelope_index(uint8_t patch, uint8_t vel);
+
+/* Entry of the envelope table; 0 if index is out of range */
+int chip16_envelope(int index, uint16_t *ad, uint16_t *vtsr);
+
+/* Write the envelope table */
+int chip16_write_envelopes(const char *fn_env);
+
+/* Voice reduction policies: which of the notes held at once is played */
+#define CHIP16_VOICE_ALL        0   /* none; every NOTE ON cuts the last */
+#define CHIP16_VOICE_HIGHEST    1
+#define CHIP16_VOICE_LOWEST     2
+#define CHIP16_VOICE_LAST       3
+#define CHIP16_VOICE_CHANNEL    4   /* by channel rank, then the last */
+
+/* Changes made to the notes as they are converted */
+typedef struct
+{
+    /* Semitones added to every key */
+    int transpose;
+    /* Playback speed in percent; 200 plays twice as fast */
+    uint32_t tempo;
+    /* Notes softer than this are dropped */
+    uint8_t min_vel;
+    /* Channels kept, one bit each, and range of keys kept, before
+     * transposing; notes transposed out of range are dropped too */
+    uint16_t channels;
+    uint8_t key_lo, key_hi;
+    /* Bounds of note lengths in ms, after tempo scaling; 0 for none */
+    uint32_t min_len, max_len;
+    /* Voice reduction policy, and channel ranks for CHIP16_VOICE_CHANNEL
+     * (higher ranks win) */
+    int voice;
+    uint8_t chan_rank[NUM_CHANNELS];
+    /* Write envelope table indices instead of ADSR words */
+    int env_index;
+    /* Play the percussion channel as drum sounds */
+    int drums;
+
+} chip16_xform_t;
+
+/* Set xf to change nothing */
+void chip16_xform_init(chip16_xform_t *xf);
+
+/* Options for the conversion of a MIDI file */
+typedef struct
+{
+    /* Applied to every note */
+    chip16_xform_t xform;
+    /* Markers from every track, in time order */
+    chip16_marker_t *markers;
+    int num_markers;
+    /* Seek table output file, or NULL */
+    const char *fn_seek;
+    /* Conversion cache for all tracks, or NULL */
+    const char *fn_cache;
+    /* Envelope table output file, or NULL */
+    const char *fn_env;
+
+} chip16_opts_t;
+
+/* Interleaved packets for several voices: delay since the previous
+ * packet of any voice, voice, then frequency, length and ADSR */
+#define CHIP16_VOICE_PACKET_WORDS 5
+
+/* Receives each packet, in order */
+typedef void (*chip16_sink_fn)(void *ctx, const int16_t *packet);
+
+/* Packets kept in memory */
+typedef struct
+{
+    int16_t *packets;
+    int num, cap;
+
+} chip16_packets_t;
+
+/* Pending notes written to the spill file at once */
+#define CHIP16_SPILL_BATCH 64
+
+/* A note held down, when reducing voices */
+typedef struct
+{
+    /* Higher plays first */
+    uint64_t prio;
+    int event;
+    uint8_t key;
+    uint8_t vel;
+    uint8_t channel;
+    uint8_t patch;
+    uint8_t drum;
+
+} chip16_held_t;
+
+/*
+ * Incremental event to packet converter.
+ *
+ * Events are pushed one at a time; a packet is written as soon as the
+ * note's NOTE OFF is seen and every earlier note has been written, so
+ * only notes overlapping the oldest sounding one are held in memory.
+ * With max_hold set, no packet is held back longer than that: a note
+ * still sounding by then is written up to that point and continues as
+ * a new note, so the delay between input and output is bounded.
+ *
+ * With a voice reduction policy, held notes are kept in a heap by
+ * priority instead, and the one on top is played: a packet is written
+ * each time the top note changes, so the output is monophonic.
+ *
+ * Drum hits last as long as their sound, whatever their NOTE OFF, so
+ * they never hold back other notes; when reducing voices, they cut in
+ * over the held notes, which carry on after them.
+ *
+ * With a spill file set (and no max_hold), at most max_notes note slots
+ * are allocated at once, counting both arrays while the queue grows, and
+ * pending notes past those are appended to the file in batches, updated
+ * there when they end, and read back as the queue drains. Markers past
+ * max_markers, if set, are dropped.
+ */
+typedef struct
+{
+    /* Milliseconds per pulse; may be changed between events */
+    uint32_t mspp;
+    /* If set, notes sounding for this many pulses are written in parts */
+    uint32_t max_hold;
+    /* Identity unless set after chip16_conv_init() */
+    chip16_xform_t xform;
+    /* Time of the last event, in pulses */
+    uint32_t clock;
+    uint32_t last_note_start;
+    /* The last packet written, as a sounding note */
+    uint32_t last_note_end;
+    int16_t last_hz;
+    int16_t last_adsr;
+    /* Markers, in time order; those before next_marker are resolved */
+    chip16_marker_t *markers;
+    int num_markers, cap_markers, next_marker;
+    /* Pending notes, in start order (ring buffer indexed by sequence) */
+    chip16_note_t *notes;
+    uint32_t head, tail, cap;
+    /* Sequence number + 1 of the sounding note per channel/key, or 0;
+     * when reducing voices, heap index + 1 of the held note */
+    uint32_t sounding[NUM_CHANNELS][NUM_NOTES];
+    /* Spill file for the pending notes past max_notes, or NULL; the last
+     * spilled of them are there, from sequence spill_base on, but for the
+     * last spill_buffered, still in spill_buf */
+    FILE *spill;
+    uint32_t max_notes;
+    uint32_t spilled, spill_base;
+    chip16_note_t spill_buf[CHIP16_SPILL_BATCH];
+    uint32_t spill_buffered;
+    /* Sequence at the file position, and the last access made there */
+    uint32_t spill_at;
+    int spill_mode;
+    /* Set once the spill file failed; no more notes are written then */
+    int spill_error;
+    /* Notes ever spilled, and most bytes of notes allocated at once */
+    uint32_t total_spilled;
+    size_t notes_peak;
+    /* Most markers kept, 0 for any number, and markers dropped */
+    int max_markers;
+    int dropped_markers;
+    /* Current patch of each channel */
+    uint8_t patch[NUM_CHANNELS];
+    /* Held notes as a max-heap, and the note being played, if any */
+    chip16_held_t *held;
+    int num_held;
+    chip16_note_t playing;
+    /* Drum hit playing over the held notes until drum_until, if drum_on */
+    chip16_held_t drum_hit;
+    uint32_t drum_until;
+    int drum_on;
+    /* Events seen and packets written */
+    int num_events;
+    int total;
+
+    chip16_sink_fn sink;
+    void *ctx;
+
+} chip16_conv_t;
+
+/* Prepare a converter writing packets to sink */
+void chip16_conv_init(chip16_conv_t *c, uint32_t mspp,
+                      chip16_sink_fn sink, void *ctx);
+
+/* Push the next event of the track */
+void chip16_conv_event(chip16_conv_t *c, const midi_event_t *e);
+
+/* Add a marker (copied), to be resolved with the first note from its time */
+void chip16_conv_marker(chip16_conv_t *c, const chip16_marker_t *m);
+
+/* Let time pass without an event, e.g. for live input */
+void chip16_conv_advance(chip16_conv_t *c, uint32_t dt);
+
+/* End the track: release sounding notes, write the rest and clean up;
+ * markers stay resolved in c->markers until chip16_conv_free() */
+void chip16_conv_finish(chip16_conv_t *c);
+
+/* Release the markers */
+void chip16_conv_free(chip16_conv_t *c);
+
+/* Fill m with a MARKER/CUE_PT meta event at tick; 0 if e is neither */
+int chip16_marker_from_event(chip16_marker_t *m, const midi_event_t *e,
+                             uint32_t tick);
+
+/* Collect the markers of all tracks in time order; returns their number */
+int chip16_find_markers(midi_track_t *tracks, int num_tracks,
+                        chip16_marker_t **markers);
+
+/* Write the resolved markers as a seek table */
+int chip16_write_seek(const char *fn_seek, chip16_conv_t *c);
+
+/* Packet sink writing to a FILE * context */
+void chip16_file_sink(void *ctx, const int16_t *packet);
+
+/* Packet sink appending to a chip16_packets_t context */
+void chip16_packets_sink(void *ctx, const int16_t *packet);
+
+/* Track number selecting every track in turn */
+#define CHIP16_ALL_TRACKS -1
+
+/*
+ * Conversion of a whole MIDI file, fed its events in file order as they
+ * are decoded: picks the track, follows its tempo and gathers markers.
+ */
+typedef struct
+{
+    chip16_conv_t conv;
+    chip16_opts_t *opts;
+    chip16_sink_fn sink;
+    void *ctx;
+    /* With CHIP16_ALL_TRACKS, called after each track if set */
+    void (*track_end)(void *end_ctx, int track);
+    void *end_ctx;
+    /* Track to convert, and whether it has been reached */
+    int track;
+    int started;
+    /* Time in the current track, for markers */
+    int cur_track;
+    uint32_t clock;
+    /* Packets written */
+    int total;
+
+} chip16_file_conv_t;
+
+void chip16_file_conv_init(chip16_file_conv_t *fc, int track,
+                           chip16_opts_t *opts, chip16_sink_fn sink, void *ctx);
+
+/* Push the next event of the file; ppqn from the header */
+void chip16_file_conv_event(chip16_file_conv_t *fc, uint32_t ppqn, int track,
+                            midi_event_t *e);
+
+/* Write the rest; returns the number of packets, or < 0 on error */
+int chip16_file_conv_finish(chip16_file_conv_t *fc);
+
+/* Write a standard MIDI track straight to file in Chip16 assembly; ppqn
+ * from the header */
 int chip16_write_track(const char *fn_asm, const char *fn_notes,
-                       midi_track_t *track);
+                       midi_track_t *track, uint32_t ppqn,
+                       chip16_opts_t *opts);
+
+/* Convert one track of a MIDI file read incrementally from fmid, passing
+ * packets to sink; returns the number of packets, or < 0 on error */
+int chip16_convert_stream(FILE *fmid, int track, chip16_opts_t *opts,
+                          chip16_sink_fn sink, void *ctx);
+
+/* Convert every track with notes, reading the MIDI file once; each goes
+ * to its own file, named after fn_notes, or all are interleaved into
+ * fn_notes as voices */
+int chip16_write_all(FILE *fmid, const char *fn_notes, chip16_opts_t *opts,
+                     int interleave);
+
+/* Write the packets of each track as chip16_write_all() does; tracks
+ * without packets are left out */
+int chip16_write_tracks(const char *fn_notes, const chip16_packets_t *tracks,
+                        int num_tracks, int interleave);
+
+/* Convert one track of a MIDI file read incrementally from fmid */
+int chip16_write_stream(FILE *fmid, const char *fn_notes, int track,
+                        chip16_opts_t *opts);
 
 #endif
 
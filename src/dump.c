@@ -0,0 +1,360 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dump.h"
+#include "midi.h"
+#include "stream.h"
+
+/* Bytes read from the MIDI file at a time */
+#define READ_CHUNK 65536
+
+/* Output buffer size, and room left for the longest line: 255 data bytes
+ * and 255 characters of text escaped as \u00XX, plus the other fields */
+#define DUMP_BUF        65536
+#define DUMP_LINE_MAX   4096
+
+/* Names of channel messages by high nibble, and system messages by low */
+static const char *cmd_names[8] = {
+    "NOTE_OFF", "NOTE_ON", "AFTERTOUCH", "CONT_CTRL", "PATCH_CHG",
+    "CHAN_PRSS", "PITCH_BEND", NULL
+};
+static const char *sys_names[16] = {
+    "SYSEX_START", "TCQF", "SONG_POS", "SONG_SEL", NULL, NULL, "TUNE_REQ",
+    "SYSEX_END", "TIMING_CLK", NULL, "START", "CONTINUE", "STOP", NULL,
+    "ACT_SENS", "SYS_RESET"
+};
+static const char *meta_names[128] = {
+    [MIDI_META_SEQ_NUM] = "SEQ_NUM",
+    [MIDI_META_TEXT] = "TEXT",
+    [MIDI_META_COPYRIGHT] = "COPYRIGHT",
+    [MIDI_META_SEQ_NAME] = "SEQ_NAME",
+    [MIDI_META_INSTR] = "INSTR",
+    [MIDI_META_LYRIC] = "LYRIC",
+    [MIDI_META_MARKER] = "MARKER",
+    [MIDI_META_CUE_PT] = "CUE_PT",
+    [MIDI_META_PRG_NAME] = "PRG_NAME",
+    [MIDI_META_DEV_NAME] = "DEV_NAME",
+    [MIDI_META_END] = "END",
+    [MIDI_META_TEMPO] = "TEMPO",
+    [MIDI_META_TIMESIG] = "TIMESIG",
+    [MIDI_META_KEYSIG] = "KEYSIG",
+    [MIDI_META_PROPR] = "PROPR"
+};
+
+static const char hex[] = "0123456789abcdef";
+
+/* A tempo change: from tick on, at the time us, tempo us per quarter */
+typedef struct
+{
+    uint32_t tick;
+    uint64_t us;
+    uint32_t tempo;
+
+} tempo_change_t;
+
+typedef struct
+{
+    FILE *out;
+    int format;
+    midi_stream_t stream;
+
+    char buf[DUMP_BUF];
+    size_t len;
+
+    /* Current track and time in it */
+    int track;
+    uint32_t tick;
+    /* Tempo map so far, and the change in effect in the current track */
+    tempo_change_t *tempos;
+    int num_tempos, cap_tempos, cur_tempo;
+    int events;
+
+} dump_t;
+
+static void flush_buf(dump_t *d)
+{
+    fwrite(d->buf, 1, d->len, d->out);
+    d->len = 0;
+}
+
+static void put_str(dump_t *d, const char *s)
+{
+    while(*s)
+        d->buf[d->len++] = *s++;
+}
+
+static void put_u64(dump_t *d, uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    while(n)
+        d->buf[d->len++] = tmp[--n];
+}
+
+/* Time in ms with 3 decimals */
+static void put_ms(dump_t *d, uint64_t us)
+{
+    put_u64(d, us / 1000);
+    d->buf[d->len++] = '.';
+    d->buf[d->len++] = '0' + us / 100 % 10;
+    d->buf[d->len++] = '0' + us / 10 % 10;
+    d->buf[d->len++] = '0' + us % 10;
+}
+
+static void put_hex(dump_t *d, uint8_t v)
+{
+    d->buf[d->len++] = hex[v >> 4];
+    d->buf[d->len++] = hex[v & 0xF];
+}
+
+static const char* status_name(uint8_t status)
+{
+    return status < MIDI_CMD_NON_MUS ? cmd_names[(status >> 4) & 7] :
+           sys_names[status & 0xF];
+}
+
+/* Name of a status or meta type, or its hex value */
+static void put_name(dump_t *d, const char *name, uint8_t v)
+{
+    if(name != NULL) {
+        put_str(d, name);
+    } else {
+        put_str(d, "0x");
+        put_hex(d, v);
+    }
+}
+
+static void put_csv_text(dump_t *d, const midi_event_t *e)
+{
+    int i;
+
+    d->buf[d->len++] = '"';
+    for(i = 0; i < e->param_len; i++) {
+        if(e->params[i] == '"')
+            d->buf[d->len++] = '"';
+        d->buf[d->len++] = e->params[i];
+    }
+    d->buf[d->len++] = '"';
+}
+
+static void put_json_text(dump_t *d, const midi_event_t *e)
+{
+    uint8_t c;
+    int i;
+
+    d->buf[d->len++] = '"';
+    for(i = 0; i < e->param_len; i++) {
+        c = e->params[i];
+        if(c == '"' || c == '\\') {
+            d->buf[d->len++] = '\\';
+            d->buf[d->len++] = c;
+        } else if(c < 0x20 || c >= 0x7F) {
+            /* Text is taken as Latin-1 */
+            put_str(d, "\\u00");
+            put_hex(d, c);
+        } else {
+            d->buf[d->len++] = c;
+        }
+    }
+    d->buf[d->len++] = '"';
+}
+
+static void put_csv(dump_t *d, const midi_event_t *e, uint64_t us)
+{
+    int i;
+
+    put_u64(d, d->track);
+    d->buf[d->len++] = ',';
+    put_u64(d, d->tick);
+    d->buf[d->len++] = ',';
+    put_ms(d, us);
+    d->buf[d->len++] = ',';
+    if(e->status < MIDI_CMD_NON_MUS)
+        put_u64(d, e->channel);
+    d->buf[d->len++] = ',';
+    put_name(d, status_name(e->status), e->status);
+    d->buf[d->len++] = ',';
+    if(e->status == MIDI_CMD_SYS_RESET)
+        put_name(d, e->meta < 0x80 ? meta_names[e->meta] : NULL, e->meta);
+    d->buf[d->len++] = ',';
+    for(i = 0; i < e->param_len; i++) {
+        if(i)
+            d->buf[d->len++] = ' ';
+        put_hex(d, e->params[i]);
+    }
+    d->buf[d->len++] = ',';
+    if(e->is_ascii)
+        put_csv_text(d, e);
+    d->buf[d->len++] = '\n';
+}
+
+static void put_json(dump_t *d, const midi_event_t *e, uint64_t us)
+{
+    int i;
+
+    put_str(d, "{\"track\":");
+    put_u64(d, d->track);
+    put_str(d, ",\"tick\":");
+    put_u64(d, d->tick);
+    put_str(d, ",\"time\":");
+    put_ms(d, us);
+    put_str(d, ",\"channel\":");
+    if(e->status < MIDI_CMD_NON_MUS)
+        put_u64(d, e->channel);
+    else
+        put_str(d, "null");
+    put_str(d, ",\"status\":\"");
+    put_name(d, status_name(e->status), e->status);
+    put_str(d, "\",\"meta\":");
+    if(e->status == MIDI_CMD_SYS_RESET) {
+        d->buf[d->len++] = '"';
+        put_name(d, e->meta < 0x80 ? meta_names[e->meta] : NULL, e->meta);
+        d->buf[d->len++] = '"';
+    } else {
+        put_str(d, "null");
+    }
+    put_str(d, ",\"params\":[");
+    for(i = 0; i < e->param_len; i++) {
+        if(i)
+            d->buf[d->len++] = ',';
+        put_u64(d, e->params[i]);
+    }
+    put_str(d, "],\"text\":");
+    if(e->is_ascii)
+        put_json_text(d, e);
+    else
+        put_str(d, "null");
+    put_str(d, "}\n");
+}
+
+/* Time of the current tick in us */
+static uint64_t tick_us(dump_t *d)
+{
+    uint16_t tdiv = hdr_tdiv_le(&d->stream.hdr);
+    tempo_change_t *t;
+    int fps;
+
+    /* SMPTE: frames per second (negative) and ticks per frame */
+    if(tdiv & 0x8000) {
+        fps = -(int8_t)(tdiv >> 8);
+        return fps && (tdiv & 0xFF) ?
+               (uint64_t) d->tick * 1000000 / (fps * (tdiv & 0xFF)) : 0;
+    }
+    if(!tdiv)
+        return 0;
+
+    while(d->cur_tempo + 1 < d->num_tempos &&
+          d->tempos[d->cur_tempo + 1].tick <= d->tick)
+        d->cur_tempo++;
+    t = &d->tempos[d->cur_tempo];
+    return t->us + (uint64_t)(d->tick - t->tick) * t->tempo / tdiv;
+}
+
+/* Add a tempo change at the current tick, if not before the last one */
+static void add_tempo(dump_t *d, uint32_t tempo, uint64_t us)
+{
+    tempo_change_t *t;
+
+    if(d->tempos[d->num_tempos - 1].tick > d->tick)
+        return;
+    if(d->num_tempos == d->cap_tempos) {
+        d->cap_tempos *= 2;
+        d->tempos = realloc(d->tempos, d->cap_tempos * sizeof(tempo_change_t));
+    }
+    t = &d->tempos[d->num_tempos++];
+    t->tick = d->tick;
+    t->us = us;
+    t->tempo = tempo;
+}
+
+static void dump_event(void *ctx, int track, midi_event_t *e)
+{
+    dump_t *d = ctx;
+    uint64_t us;
+
+    if(track != d->track) {
+        d->track = track;
+        d->tick = 0;
+        d->cur_tempo = 0;
+    }
+    d->tick += e->dt;
+    us = tick_us(d);
+    if(e->status == MIDI_CMD_SYS_RESET && e->meta == MIDI_META_TEMPO &&
+       e->param_len >= 3)
+        add_tempo(d, e->params[0] << 16 | e->params[1] << 8 | e->params[2],
+                  us);
+
+    if(d->len + DUMP_LINE_MAX > DUMP_BUF)
+        flush_buf(d);
+    if(d->format == DUMP_JSONL)
+        put_json(d, e, us);
+    else
+        put_csv(d, e, us);
+    d->events++;
+}
+
+int dump_events(FILE *fmid, FILE *out, int format)
+{
+    dump_t *d;
+    uint8_t *buf;
+    size_t len;
+    int err, events;
+
+    d = malloc(sizeof(dump_t));
+    buf = malloc(READ_CHUNK);
+    memset(d, 0, sizeof(*d));
+    d->out = out;
+    d->format = format;
+    d->track = -1;
+    /* 120 bpm until told otherwise */
+    d->cap_tempos = 16;
+    d->tempos = malloc(d->cap_tempos * sizeof(tempo_change_t));
+    d->tempos[0].tick = 0;
+    d->tempos[0].us = 0;
+    d->tempos[0].tempo = 500000;
+    d->num_tempos = 1;
+
+    if(format == DUMP_CSV)
+        put_str(d, "track,tick,time,channel,status,meta,params,text\n");
+    midi_stream_init(&d->stream, dump_event, d);
+    while((len = fread(buf, 1, READ_CHUNK, fmid)) > 0) {
+        if(midi_stream_feed(&d->stream, buf, len))
+            break;
+    }
+    err = midi_stream_finish(&d->stream);
+    flush_buf(d);
+    fflush(out);
+
+    if(err)
+        fprintf(stderr, "error: MIDI stream error %d near byte %u\n",
+                err, d->stream.offset);
+    events = d->events;
+    free(d->tempos);
+    free(d);
+    free(buf);
+
+    return err ? -1 : events;
+}
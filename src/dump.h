@@ -0,0 +1,42 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DUMP_H
+#define DUMP_H
+
+/*
+ * Export of decoded MIDI events for analysis tools.
+ *
+ * Every event of every track is written as one line, with its track, its
+ * absolute time in pulses and in ms (following the tempo changes seen so
+ * far, which is the tempo map for files keeping it in the first track),
+ * channel, status and meta type names, data bytes and text, as either
+ * CSV with a header line or JSON Lines.
+ * The file is decoded as it is read, and lines are formatted into a large
+ * buffer without stdio calls per field.
+ */
+
+#include <stdio.h>
+
+/* Output formats */
+#define DUMP_CSV    0
+#define DUMP_JSONL  1
+
+/* Dump the events of fmid to out; returns the number of events, or < 0 */
+int dump_events(FILE *fmid, FILE *out, int format);
+
+#endif
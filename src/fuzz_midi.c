@@ -0,0 +1,93 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fuzzing entry point for the in-memory decoder.
+ *
+ * Each input is copied into a MIDI_PAD padded buffer, as main does with
+ * a file, and its tracks are read with midi_read_track() until the end.
+ * Built with libFuzzer by "make fuzz"; with FUZZ_REPLAY, a main() runs
+ * the inputs named on the command line instead, e.g. a corpus or crash
+ * files, under the sanitizers of any compiler ("make fuzz-replay").
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "midi.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t *buf, *end;
+    void *p;
+    midi_header_t h;
+    midi_track_t t;
+
+    buf = calloc(1, size + MIDI_PAD);
+    memcpy(buf, data, size);
+    end = buf + size;
+
+    /* Tracks follow a valid header, or start right away with 96 ppqn */
+    memset(&h, 0, sizeof(h));
+    h.time_div[1] = 96;
+    p = buf;
+    if(size >= sizeof(h) && !memcmp(buf, "MThd", 4) &&
+       hdr_size_le((midi_header_t *) buf) <= size - 8) {
+        memcpy(&h, buf, sizeof(h));
+        p = buf + 8 + hdr_size_le(&h);
+    }
+
+    /* Every call consumes at least a chunk header, or all that is left */
+    while((uint8_t *) p < end) {
+        t = midi_read_track(&p, end, &h);
+        midi_free_track(&t);
+    }
+    free(buf);
+
+    return 0;
+}
+
+#ifdef FUZZ_REPLAY
+int main(int argc, char **argv)
+{
+    FILE *f;
+    uint8_t *data;
+    long size;
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if((f = fopen(argv[i], "rb")) == NULL) {
+            fprintf(stderr,"error: could not open %s\n", argv[i]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        data = malloc(size + 1);
+        size = fread(data, 1, size, f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    printf("%d inputs decoded\n", argc - 1);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,210 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "live.h"
+#include "chip16.h"
+#include "stream.h"
+
+/* Converter time unit; at 1 ms per 16 pulses, packets come out in ms */
+#define PULSES_PER_MS 16
+
+/* Bytes read at a time; live input rarely has more pending */
+#define LIVE_CHUNK 256
+
+typedef struct
+{
+    midi_stream_t stream;
+    chip16_conv_t conv;
+    FILE *fnotes;
+    /* Monotonic clock at start, in ns */
+    uint64_t t0;
+    /* Arrival time of the bytes being decoded, in pulses */
+    uint32_t now;
+    /* Latency of each packet, in us */
+    uint32_t *lat;
+    size_t num_lat, cap_lat;
+
+} live_t;
+
+static volatile sig_atomic_t stop;
+
+static void on_sigint(int sig)
+{
+    stop = 1;
+}
+
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t to_pulses(live_t *lv, uint64_t ns)
+{
+    return (ns - lv->t0) * PULSES_PER_MS / 1000000;
+}
+
+static void live_sink(void *ctx, const int16_t *packet)
+{
+    live_t *lv = ctx;
+    uint64_t start;
+
+    chip16_file_sink(lv->fnotes, packet);
+    fflush(lv->fnotes);
+
+    /* Time from the note (part) starting to its packet being out */
+    start = lv->t0 + (uint64_t) lv->conv.last_note_start * 1000000 /
+            PULSES_PER_MS;
+    if(lv->num_lat == lv->cap_lat) {
+        lv->cap_lat = lv->cap_lat ? lv->cap_lat * 2 : 256;
+        lv->lat = realloc(lv->lat, lv->cap_lat * sizeof(uint32_t));
+    }
+    lv->lat[lv->num_lat++] = (mono_ns() - start) / 1000;
+}
+
+static void live_event(void *ctx, int track, midi_event_t *e)
+{
+    live_t *lv = ctx;
+
+    e->dt = lv->now - lv->conv.clock;
+    chip16_conv_event(&lv->conv, e);
+}
+
+/* Time in ms until the oldest sounding note must be written, or a drum
+ * hit over held notes ends, or -1 */
+static int next_timeout(live_t *lv)
+{
+    chip16_conv_t *c = &lv->conv;
+    uint32_t now, due;
+
+    if(c->xform.voice == CHIP16_VOICE_ALL) {
+        if(c->head == c->tail)
+            return -1;
+        due = c->notes[c->head % c->cap].start + c->max_hold;
+    } else {
+        /* Voice reduction plays one note at a time, outside the queue */
+        if(!c->playing.open)
+            return -1;
+        due = c->playing.start + c->max_hold;
+        if(c->drum_on && c->drum_until < due)
+            due = c->drum_until;
+    }
+    now = to_pulses(lv, mono_ns());
+    return due > now ? (due - now + PULSES_PER_MS - 1) / PULSES_PER_MS : 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(live_t *lv)
+{
+    uint32_t *l = lv->lat;
+    size_t n = lv->num_lat;
+
+    if(!n) {
+        printf("latency: no packets written\n");
+        return;
+    }
+    qsort(l, n, sizeof(uint32_t), cmp_u32);
+    printf("latency: %u packets, p50 %u us, p90 %u us, p99 %u us, max %u us\n",
+           (unsigned) n, l[(n - 1) * 50 / 100], l[(n - 1) * 90 / 100],
+           l[(n - 1) * 99 / 100], l[n - 1]);
+}
+
+int live_convert(const char *fn_dev, const char *fn_notes,
+                 uint32_t max_latency, const chip16_opts_t *opts)
+{
+    live_t lv;
+    struct pollfd pfd;
+    uint8_t buf[LIVE_CHUNK];
+    ssize_t len;
+    int fd;
+
+    /* Opening a FIFO blocks until a writer shows up */
+    if((fd = open(fn_dev, O_RDONLY)) < 0) {
+        printf("error: could not open %s for reading\n", fn_dev);
+        return -2;
+    }
+    memset(&lv, 0, sizeof(lv));
+    if((lv.fnotes = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
+        close(fd);
+        return -2;
+    }
+
+    chip16_conv_init(&lv.conv, 1, live_sink, &lv);
+    lv.conv.xform = opts->xform;
+    lv.conv.max_hold = max_latency * PULSES_PER_MS;
+    midi_stream_init_wire(&lv.stream, live_event, &lv);
+    signal(SIGINT, on_sigint);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    lv.t0 = mono_ns();
+
+    printf("listening on %s, latency bound %u ms\n", fn_dev, max_latency);
+    while(!stop) {
+        if(poll(&pfd, 1, next_timeout(&lv)) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        lv.now = to_pulses(&lv, mono_ns());
+        if(pfd.revents & (POLLIN | POLLHUP)) {
+            len = read(fd, buf, sizeof(buf));
+            if(len < 0 && errno == EINTR)
+                continue;
+            /* End of input, e.g. the FIFO writer went away */
+            if(len <= 0)
+                break;
+            midi_stream_feed(&lv.stream, buf, len);
+        }
+        chip16_conv_advance(&lv.conv, lv.now - lv.conv.clock);
+    }
+
+    lv.now = to_pulses(&lv, mono_ns());
+    chip16_conv_advance(&lv.conv, lv.now - lv.conv.clock);
+    if(midi_stream_finish(&lv.stream))
+        printf("warning: input ended inside a MIDI message\n");
+    chip16_conv_finish(&lv.conv);
+    printf("wrote %d notes\n", lv.conv.total);
+    print_latency(&lv);
+
+    free(lv.lat);
+    fclose(lv.fnotes);
+    close(fd);
+    signal(SIGINT, SIG_DFL);
+
+    return 1;
+}
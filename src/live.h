@@ -0,0 +1,41 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIVE_H
+#define LIVE_H
+
+/*
+ * Live conversion of raw MIDI input.
+ *
+ * Bytes are read from a FIFO or MIDI character device as they arrive and
+ * timestamped with the monotonic clock; note packets are written (and
+ * flushed) at most max_latency ms after their note started.
+ */
+
+#include <stdint.h>
+
+#include "chip16.h"
+
+/* Default bound on the delay between a NOTE ON and its packet, in ms */
+#define LIVE_MAX_LATENCY 100
+
+/* Convert until end of input or SIGINT with the transforms of opts, then
+ * print latency percentiles */
+int live_convert(const char *fn_dev, const char *fn_notes,
+                 uint32_t max_latency, const chip16_opts_t *opts);
+
+#endif
@@ -19,62 +19,419 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 
 #include "midi.h"
 #include "chip16.h"
+#include "live.h"
+#include "render.h"
+#include "bank.h"
+#include "pipeline.h"
+#include "dump.h"
+#include "cache.h"
+#include "budget.h"
 
 extern const char *str_patch[128];
 
+/* Fastest playback speed, in percent */
+#define MAX_TEMPO 10000
+/* Longest note length, in ms, as a packet word holds it */
+#define MAX_LENGTH 32767
+
+/* Channel mask from a list such as "0,1,9" */
+static uint16_t parse_channels(const char *arg)
+{
+    uint16_t mask = 0;
+    char *end;
+    long c;
+
+    for(;;) {
+        c = strtol(arg, &end, 10);
+        if(end == arg || c < 0 || c >= NUM_CHANNELS) {
+            fprintf(stderr,"warning: bad channel list '%s', keeping all\n",
+                    arg);
+            return 0xFFFF;
+        }
+        mask |= 1 << c;
+        if(*end != ',')
+            break;
+        arg = end + 1;
+    }
+
+    return mask;
+}
+
+/* Voice reduction policy by name, or channels by priority: "9,0,1" ranks
+ * channel 9 first; 0 if not understood */
+static int parse_voice(const char *arg, chip16_xform_t *xf)
+{
+    char *end;
+    long c;
+    int rank;
+
+    if(!strcmp(arg, "highest"))
+        return xf->voice = CHIP16_VOICE_HIGHEST;
+    if(!strcmp(arg, "lowest"))
+        return xf->voice = CHIP16_VOICE_LOWEST;
+    if(!strcmp(arg, "last"))
+        return xf->voice = CHIP16_VOICE_LAST;
+
+    memset(xf->chan_rank, 0, sizeof(xf->chan_rank));
+    for(rank = NUM_CHANNELS; ; rank--) {
+        c = strtol(arg, &end, 10);
+        if(end == arg || c < 0 || c >= NUM_CHANNELS)
+            return 0;
+        xf->chan_rank[c] = rank;
+        if(*end != ',')
+            break;
+        arg = end + 1;
+    }
+
+    return xf->voice = CHIP16_VOICE_CHANNEL;
+}
+
+/* Byte count such as "512K", "64M" or "1G"; 0 if not understood */
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+
+    if(end == arg)
+        return 0;
+    switch(*end) {
+    case 'k': case 'K':
+        return (size_t) n << 10;
+    case 'm': case 'M':
+        return (size_t) n << 20;
+    case 'g': case 'G':
+        return (size_t) n << 30;
+    case '\0':
+        return n;
+    default:
+        return 0;
+    }
+}
+
+/* Parameter of the option at argv[*i], or NULL if missing */
+static char* opt_param(int argc, char **argv, int *i)
+{
+    if(*i + 1 < argc)
+        return argv[++*i];
+    fprintf(stderr,"warning: no parameter passed to '%s', ignoring\n",
+            argv[*i]);
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     void *p;
     FILE *fmid;
-    int size, i, j, t, channel;
-    uint8_t *bufmid;
+    int size, i, j, t, channel, stream, live, latency, bank, num_inputs;
+    int all, interleave, pipeline, dump, format;
+    FILE *fout;
+    uint8_t *bufmid, *end, *chunk;
     midi_header_t *h;
     midi_track_t *tc;
     uint16_t tdiv;
+    const char *fn_mid, *fn_notes, *fn_wav;
+    char *arg, **inputs;
+    chip16_opts_t opts;
+    size_t max_memory;
+    long fsize, n;
 
     fmid = NULL, tc = NULL, bufmid = p = h = NULL;
+    fn_mid = NULL, fn_notes = NULL, fn_wav = NULL;
+    channel = -1, stream = 0, live = 0, latency = LIVE_MAX_LATENCY;
+    all = 0, interleave = 0, pipeline = 0, format = DUMP_CSV;
+    max_memory = 0;
+    memset(&opts, 0, sizeof(opts));
+    chip16_xform_init(&opts.xform);
+    inputs = malloc(argc * sizeof(char *));
+    num_inputs = 0;
+
+    /* "midi16 bank ..." packs several songs */
+    bank = argc > 1 && !strcmp(argv[1], "bank");
+    /* "midi16 dump ..." exports the events */
+    dump = argc > 1 && !strcmp(argv[1], "dump");
+
+    for(i = 1 + bank + dump; i < argc; i++) {
+        if(!strcmp(argv[i], "--channel") || !strcmp(argv[i], "-c")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL)
+                channel = atoi(arg);
+        }
+        else if(!strcmp(argv[i], "--output") || !strcmp(argv[i], "-o"))
+            fn_notes = opt_param(argc, argv, &i);
+        else if(!strcmp(argv[i], "--render"))
+            fn_wav = opt_param(argc, argv, &i);
+        else if(!strcmp(argv[i], "--seek"))
+            opts.fn_seek = opt_param(argc, argv, &i);
+        else if(!strcmp(argv[i], "--envelopes")) {
+            if((opts.fn_env = opt_param(argc, argv, &i)) != NULL)
+                opts.xform.env_index = 1;
+        }
+        else if(!strcmp(argv[i], "--cache"))
+            opts.fn_cache = opt_param(argc, argv, &i);
+        else if(!strcmp(argv[i], "--transpose")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL)
+                opts.xform.transpose = atoi(arg);
+        }
+        else if(!strcmp(argv[i], "--tempo")) {
+            if((arg = opt_param(argc, argv, &i)) == NULL)
+                continue;
+            n = strtol(arg, NULL, 10);
+            if(n < 1 || n > MAX_TEMPO)
+                fprintf(stderr,"warning: tempo must be 1 to %d%%, "
+                        "ignoring '%s'\n", MAX_TEMPO, arg);
+            else
+                opts.xform.tempo = n;
+        }
+        else if(!strcmp(argv[i], "--min-velocity")) {
+            if((arg = opt_param(argc, argv, &i)) == NULL)
+                continue;
+            n = strtol(arg, NULL, 10);
+            if(n < 0 || n > 127)
+                fprintf(stderr,"warning: velocity must be 0 to 127, "
+                        "clamping '%s'\n", arg);
+            opts.xform.min_vel = n < 0 ? 0 : n > 127 ? 127 : n;
+        }
+        else if(!strcmp(argv[i], "--channels")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL)
+                opts.xform.channels = parse_channels(arg);
+        }
+        else if(!strcmp(argv[i], "--keys")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL &&
+               (sscanf(arg, "%d-%d", &j, &t) != 2 || j < 0 || t < j ||
+                t >= NUM_NOTES))
+                fprintf(stderr,"warning: bad key range '%s', ignoring\n", arg);
+            else if(arg != NULL)
+                opts.xform.key_lo = j, opts.xform.key_hi = t;
+        }
+        else if(!strcmp(argv[i], "--voice")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL &&
+               !parse_voice(arg, &opts.xform))
+                fprintf(stderr,"warning: unknown voice policy '%s', "
+                        "ignoring\n", arg);
+        }
+        else if(!strcmp(argv[i], "--min-length")) {
+            if((arg = opt_param(argc, argv, &i)) == NULL)
+                continue;
+            n = strtol(arg, NULL, 10);
+            if(n < 0 || n > MAX_LENGTH)
+                fprintf(stderr,"warning: length must be 0 to %d ms, "
+                        "ignoring '%s'\n", MAX_LENGTH, arg);
+            else
+                opts.xform.min_len = n;
+        }
+        else if(!strcmp(argv[i], "--max-length")) {
+            if((arg = opt_param(argc, argv, &i)) == NULL)
+                continue;
+            n = strtol(arg, NULL, 10);
+            if(n < 0 || n > MAX_LENGTH)
+                fprintf(stderr,"warning: length must be 0 to %d ms, "
+                        "ignoring '%s'\n", MAX_LENGTH, arg);
+            else
+                opts.xform.max_len = n;
+        }
+        else if(!strcmp(argv[i], "--format")) {
+            if((arg = opt_param(argc, argv, &i)) == NULL)
+                continue;
+            if(!strcmp(arg, "jsonl"))
+                format = DUMP_JSONL;
+            else if(!strcmp(arg, "csv"))
+                format = DUMP_CSV;
+            else
+                fprintf(stderr,"warning: unknown format '%s', ignoring\n", arg);
+        }
+        else if(!strcmp(argv[i], "--all-channels"))
+            all = 1;
+        else if(!strcmp(argv[i], "--max-memory")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL &&
+               !(max_memory = parse_size(arg)))
+                fprintf(stderr,"warning: bad memory size '%s', ignoring\n",
+                        arg);
+        }
+        else if(!strcmp(argv[i], "--drums"))
+            opts.xform.drums = 1;
+        else if(!strcmp(argv[i], "--interleave"))
+            interleave = 1;
+        else if(!strcmp(argv[i], "--pipeline"))
+            pipeline = 1;
+        else if(!strcmp(argv[i], "--stream"))
+            stream = 1;
+        else if(!strcmp(argv[i], "--live"))
+            live = 1;
+        else if(!strcmp(argv[i], "--latency")) {
+            if((arg = opt_param(argc, argv, &i)) != NULL)
+                latency = atoi(arg);
+            if(latency < 1) {
+                fprintf(stderr,"warning: latency must be at least 1 ms\n");
+                latency = 1;
+            }
+        }
+        else if(argv[i][0] == '-' && argv[i][1] != '\0')
+            fprintf(stderr,"warning: unknown option '%s'\n", argv[i]);
+        else if(bank || num_inputs == 0)
+            inputs[num_inputs++] = argv[i];
+        else
+            fprintf(stderr,"warning: extra argument '%s', ignoring\n", argv[i]);
+    }
 
-    if(argc <= 1) {
+    if(num_inputs == 0) {
         fprintf(stderr,"error: no MIDI file specified\n");
         exit(1);
     }
+    fn_mid = inputs[0];
+
+    /* Events go to stdout unless told otherwise, so nothing else may */
+    if(dump) {
+        free(inputs);
+        fmid = strcmp(fn_mid, "-") ? fopen(fn_mid, "rb") : stdin;
+        fout = fn_notes != NULL ? fopen(fn_notes, "w") : stdout;
+        if(fmid == NULL || fout == NULL) {
+            fprintf(stderr,"error: could not open %s\n",
+                    fmid == NULL ? fn_mid : fn_notes);
+            exit(1);
+        }
+        i = dump_events(fmid, fout, format);
+        if(fmid != stdin)
+            fclose(fmid);
+        if(fout != stdout)
+            fclose(fout);
+        return i < 0;
+    }
+
+    if(fn_notes == NULL)
+        fn_notes = bank ? "mus_bank.bin" : "mus_menu.bin";
+
+    /* A bank holds one track of each song */
+    if(bank && all) {
+        fprintf(stderr,"warning: --all-channels is not supported in bank "
+                "mode, ignoring\n");
+        all = 0;
+    }
+
+    /* Only whole files are cached, track by track */
+    if(opts.fn_cache != NULL && !all) {
+        fprintf(stderr,"warning: --cache is ignored without --all-channels\n");
+        opts.fn_cache = NULL;
+    }
+
+    if(channel < 0 && !all) {
+        channel = 1;
+        printf("No channel specified for conversion, defaulting to %d\n",
+               channel);
+    }
+
+    /* The table is fixed, whatever the song uses */
+    if(opts.fn_env != NULL && chip16_write_envelopes(opts.fn_env) < 0)
+        exit(1);
+
+    if(bank) {
+        i = bank_write(fn_notes, inputs, num_inputs, channel, &opts);
+        free(inputs);
+        return i < 0;
+    }
+    free(inputs);
+
+    /* Raw MIDI from a device or FIFO, converted as it is played */
+    if(live)
+        return live_convert(fn_mid, fn_notes, latency, &opts) < 0;
 
-    fmid = fopen(argv[1],"rb");
+    /* "-" reads the MIDI file from stdin, which may be a pipe */
+    if(!strcmp(fn_mid, "-")) {
+        fmid = stdin;
+        stream = 1;
+    } else {
+        fmid = fopen(fn_mid,"rb");
+    }
     if(fmid == NULL) {
-        fprintf(stderr,"error: MIDI file %s could not be opened\n",argv[1]);
+        fprintf(stderr,"error: MIDI file %s could not be opened\n",fn_mid);
         exit(1);
     }
 
-    channel = 1;
-    if(argc > 2) {
-        if(!strcmp(argv[2], "--channel") || !strcmp(argv[2], "-c")) {
-            if(argc > 3)
-                channel = atoi(argv[3]);
-            else
-                fprintf(stderr,"warning: no parameter passed to '%s', ignoring\n",
-                        argv[2]);
-        }
+    /* Every track in one pass over the file */
+    if(all) {
+        if(max_memory)
+            fprintf(stderr,"warning: --max-memory converts one track, "
+                    "ignoring\n");
+        if(opts.fn_seek != NULL)
+            fprintf(stderr,"warning: --seek needs a single track, "
+                    "ignoring\n");
+        if(fn_wav != NULL)
+            fprintf(stderr,"warning: --render needs a single track, "
+                    "ignoring\n");
+        printf("writing chip16 notes of all tracks ... ");
+        if(opts.fn_cache != NULL)
+            i = cache_write_all(fmid, fn_notes, opts.fn_cache, &opts,
+                                interleave);
         else
-            fprintf(stderr,"warning: unknown option '%s'\n", argv[2]);
+            i = chip16_write_all(fmid, fn_notes, &opts, interleave);
+        printf("done.\n");
+        if(fmid != stdin)
+            fclose(fmid);
+        return i < 0;
+    }
 
-    } else {
-        printf("No channel specified for conversion, defaulting to %d\n",
-               channel);
+    /* One chunk at a time, within a memory budget */
+    if(max_memory) {
+        printf("writing chip16 notes to '%s' ... ", fn_notes);
+        i = budget_write(fmid, fn_notes, channel, &opts, max_memory);
+        printf("done.\n");
+        if(fmid != stdin)
+            fclose(fmid);
+        if(i > 0 && fn_wav != NULL)
+            render_notes(fn_notes, fn_wav, RENDER_RATE,
+                         opts.xform.env_index);
+        return i < 0;
     }
 
-    fseek(fmid,0,SEEK_END);
-    size = ftell(fmid);
+    /* A FIFO or device has no size to read it whole by, so stream it */
+    if(!stream && !pipeline) {
+        if(fseek(fmid, 0, SEEK_END) || (fsize = ftell(fmid)) < 0) {
+            printf("debug: %s is not seekable, streaming it\n", fn_mid);
+            stream = 1;
+        } else if(fsize > INT_MAX - MIDI_PAD) {
+            fprintf(stderr,"error: %s is too large to read whole, use "
+                    "--stream or --max-memory\n", fn_mid);
+            fclose(fmid);
+            exit(1);
+        }
+    }
+
+    /* Decode and convert as the file is read, without buffering it */
+    if(stream || pipeline) {
+        printf("streaming chip16 notes to '%s' ... ", fn_notes);
+        if(pipeline)
+            i = pipeline_write(fmid, fn_notes, channel, &opts);
+        else
+            i = chip16_write_stream(fmid, fn_notes, channel, &opts);
+        printf("done.\n");
+        if(fmid != stdin)
+            fclose(fmid);
+        if(i > 0 && fn_wav != NULL)
+            render_notes(fn_notes, fn_wav, RENDER_RATE,
+                         opts.xform.env_index);
+        return i < 0;
+    }
+
+    size = fsize;
     fseek(fmid,0,SEEK_SET);
     printf("debug: file size = %d bytes\n",size);
 
-    bufmid = malloc(size);
-    fread(bufmid,1,size,fmid);
+    /* Zero padding lets the decoder check bounds once per event */
+    bufmid = calloc(1, size + MIDI_PAD);
+    size = fread(bufmid,1,size,fmid);
     fclose(fmid);
+    end = bufmid + size;
 
     h = (midi_header_t*) bufmid;
+    if(size < sizeof(midi_header_t) || memcmp(h->id, "MThd", 4) ||
+       hdr_size_le(h) < sizeof(midi_header_t) - 8 ||
+       hdr_size_le(h) > size - 8) {
+        fprintf(stderr,"error: %s is not a MIDI file\n", fn_mid);
+        free(bufmid);
+        exit(1);
+    }
     tdiv = hdr_tdiv_le(h);
     printf("debug: id: '%c%c%c%c', size: %u, type: 0x%x, tracks: %u, "
            "timediv: %u %s\n",
@@ -83,14 +440,21 @@ int main(int argc, char **argv)
            tdiv, tdiv & 0x8000 ? "fps" : "ppq");
 
     tc = malloc(hdr_tracks_le(h) * sizeof(midi_track_t));
-    p = (bufmid + sizeof(midi_header_t));
+    /* The header chunk may be longer than the fields we know */
+    p = (bufmid + 8 + hdr_size_le(h));
     
     for(t = 0; t < hdr_tracks_le(h); t++) {
         midi_event_t *ev = NULL;
-        tc[t] = midi_read_track(&p, h);
+        chunk = p;
+        tc[t] = midi_read_track(&p, end, h);
+        if(tc[t].error)
+            fprintf(stderr,"warning: track %d: %s at byte %u, "
+                    "keeping %d events\n", t, midi_error_str(tc[t].error),
+                    (unsigned)(chunk - bufmid) + tc[t].error_pos,
+                    tc[t].num_events);
         printf("debug: [track %i] id: '%c%c%c%c', size: %u, %u bpm\n",
                t, tc[t].id[0], tc[t].id[1], tc[t].id[2], tc[t].id[3],
-               chk_size_le(&tc[t]), 60000000/tc[t].tempo);
+               chk_size_le(&tc[t]), tc[t].tempo ? 60000000/tc[t].tempo : 0);
 
 #ifdef DEBUG_EVENTS
         ev = tc[t].events;
@@ -123,9 +487,21 @@ int main(int argc, char **argv)
 
     }
     
-    printf("writing chip16 asm to 'test.s', notes to 'test.bin' ... ");
-    chip16_write_track("test.s", "test.bin", &tc[channel]);
-    printf("done.\n");
+    if(channel < hdr_tracks_le(h)) {
+        if(opts.fn_seek != NULL)
+            opts.num_markers = chip16_find_markers(tc, hdr_tracks_le(h),
+                                                   &opts.markers);
+        printf("writing chip16 notes to '%s' ... ", fn_notes);
+        i = chip16_write_track("test.s", fn_notes, &tc[channel], tdiv,
+                               &opts);
+        free(opts.markers);
+        printf("done.\n");
+        if(i > 0 && fn_wav != NULL)
+            render_notes(fn_notes, fn_wav, RENDER_RATE,
+                         opts.xform.env_index);
+    } else {
+        fprintf(stderr,"error: no track %d to convert\n", channel);
+    }
     
     for(t = 0; t < hdr_tracks_le(h); t++)
         midi_free_track(&tc[t]);
@@ -21,6 +21,7 @@
 
 #include "midi.h"
 
+/* At most 4 bytes, so never more than MIDI_PAD bytes past the end */
 static uint32_t read_varlen(uint8_t **m)
 {
     int i;
@@ -31,19 +32,73 @@ static uint32_t read_varlen(uint8_t **m)
 
     if(!(**p & 0x80))
         return *(*p)++;
-    for(i = 0; i < sizeof(uint32_t); i++) {
+    for(i = 0; i < sizeof(uint32_t) - 1; i++) {
         dt = (dt << 7) | (*(*p)++ & 0x7f);
         if(!(**p & 0x80)) 
             break;
     }
-    dt = (dt << 8) | (*(*p)++ & 0x7f);
+    dt = (dt << 7) | (*(*p)++ & 0x7f);
     return dt;
 }
 
-midi_event_t* midi_event_next(void **m, uint8_t last_status)
+/* Copy up to MIDI_CMD_MAX_SIZE bytes of meta/SysEx data, skipping the
+ * rest; the length must have been checked against the end */
+static void read_data(midi_event_t *e, uint8_t **p)
+{
+    e->param_len = e->varlen < MIDI_CMD_MAX_SIZE ?
+                   e->varlen : MIDI_CMD_MAX_SIZE;
+    memcpy(e->params, *p, e->param_len);
+    if(e->param_len < MIDI_CMD_MAX_SIZE)
+        e->params[e->param_len] = '\0';
+    *p += e->varlen;
+}
+
+int midi_cmd_param_len(uint8_t status)
+{
+    switch(status & 0xF0) {
+    case MIDI_CMD_NOTE_OFF:
+    case MIDI_CMD_NOTE_ON:
+    case MIDI_CMD_CONT_CTRL:
+    case MIDI_CMD_PITCH_BEND:
+        return 2;
+    case MIDI_CMD_AFTERTOUCH:
+    case MIDI_CMD_PATCH_CHG:
+    case MIDI_CMD_CHAN_PRSS:
+        return 1;
+    }
+    switch(status) {
+    case MIDI_CMD_TCQF:
+    case MIDI_CMD_SONG_SEL:
+        return 1;
+    case MIDI_CMD_SONG_POS:
+        return 2;
+    }
+    return 0;
+}
+
+void midi_event_set_params(midi_event_t *e, const uint8_t *data)
+{
+    e->param_len = midi_cmd_param_len(e->status);
+    if(e->status < MIDI_CMD_NON_MUS)
+        e->channel = e->status & 0x0F;
+
+    /* Pitch bend specifies 7 LSB and MSB for params */
+    if((e->status & 0xF0) == MIDI_CMD_PITCH_BEND) {
+        e->params[0] = data[0] & 0x7F;
+        e->params[1] = data[1] >> 1;
+    } else if(e->param_len == 2) {
+        e->params[0] = data[0];
+        e->params[1] = data[1];
+    } else if(e->param_len == 1) {
+        e->params[0] = data[0];
+    }
+}
+
+midi_event_t* midi_event_next(void **m, const uint8_t *end,
+                              uint8_t last_status, int *err)
 {
     midi_event_t* e;
-    uint8_t i, **p = (uint8_t **) m;
+    uint8_t **p = (uint8_t **) m;
 
     e = calloc(1, sizeof(midi_event_t));
     e->dt = read_varlen(p);
@@ -54,137 +109,129 @@ midi_event_t* midi_event_next(void **m, uint8_t last_status)
         (*p)--;
     }
 
+    /* Fixed-size parts may run into the padding; checked once below */
     switch(e->status & 0xF0) {
-    /* 2-parameter commands/events */
+    case 0x00:
+        *err = MIDI_ERR_STATUS;
+        free(e);
+        return NULL;
+    /* Channel voice commands/events, 1 or 2 parameters */
     case MIDI_CMD_NOTE_OFF:
     case MIDI_CMD_NOTE_ON:
     case MIDI_CMD_CONT_CTRL:
-        e->params[0] = *(*p)++;
-        e->params[1] = *(*p)++;
-        e->param_len = 2;
-        e->channel = e->status & 0x0F;
-        break;
-    /* 2-parameter; pitch bend specifies 7 LSB and MSB for params */
     case MIDI_CMD_PITCH_BEND:
-        e->params[0] = *(*p)++ & 0x7F;
-        e->params[1] = *(*p)++ >> 1;
-        e->param_len = 2;
-        e->channel = e->status & 0x0F;
-        break;
-    /* 1-parameter commands/events */
     case MIDI_CMD_AFTERTOUCH:
     case MIDI_CMD_PATCH_CHG:
     case MIDI_CMD_CHAN_PRSS:
-        e->params[0] = *(*p)++;
-        e->param_len = 1;
-        e->channel = e->status & 0x0F;
+        midi_event_set_params(e, *p);
+        *p += e->param_len;
         break;
     /* Special command/event F0 */
     case MIDI_CMD_NON_MUS:
         switch(e->status) {
+        /* SysEx, or in files an escape of any bytes */
         case MIDI_CMD_SYSEX_START:
+        case MIDI_CMD_SYSEX_END:
             e->varlen = read_varlen(p);
-            /* Clamp length to 255... hope this doesn't break much. */
-            e->param_len = e->varlen & 0xFF;
-            for(i = 0; i < e->param_len; i++) {
-                e->params[i] = *(*p)++;
-            }
             break;
         case MIDI_CMD_TCQF:
         case MIDI_CMD_SONG_SEL:
-            e->param_len = 1;
-            e->params[0] = *(*p)++;
-            break;
         case MIDI_CMD_SONG_POS:
-            e->param_len = 2;
-            e->params[0] = *(*p)++;
-            e->params[1] = *(*p)++;
-            break;
-        case MIDI_CMD_TUNE_REQ:
-        case MIDI_CMD_SYSEX_END:
-        case MIDI_CMD_TIMING_CLK:
-        case MIDI_CMD_START:
-        case MIDI_CMD_CONTINUE:
-        case MIDI_CMD_STOP:
-        case MIDI_CMD_ACT_SENS:
+            midi_event_set_params(e, *p);
+            *p += e->param_len;
             break;
         case MIDI_CMD_SYS_RESET:
-            switch(e->meta = *(*p)++) {
-            case MIDI_META_SEQ_NUM:
-                e->param_len = *(*p)++; /* 0 or 2 */
-                if(e->param_len) {
-                    e->params[0] = *(*p)++;
-                    e->params[1] = *(*p)++;
-                }
-                break;
-            case MIDI_META_TEXT:
-            case MIDI_META_COPYRIGHT:
-            case MIDI_META_SEQ_NAME:
-            case MIDI_META_INSTR:
-            case MIDI_META_LYRIC:
-            case MIDI_META_MARKER:
-            case MIDI_META_CUE_PT:
-            case MIDI_META_PRG_NAME:
-            case MIDI_META_DEV_NAME:
-                e->varlen = read_varlen(p);
-                e->param_len = e->varlen & 0xFF;
-                for(i = 0; i < e->param_len; i++)
-                    e->params[i] = *(*p)++;
-                e->is_ascii = 1;
-                /*printf("text: '%s'\n", (char *) e->params);*/
-                break;
-            case MIDI_META_END:
-                e->param_len = *(*p)++; /* 0 */
-                break;
-            case MIDI_META_TEMPO:
-                e->param_len = *(*p)++; /* 3 */
-                e->params[0] = *(*p)++;
-                e->params[1] = *(*p)++;
-                e->params[2] = *(*p)++;
-                break;
-            case MIDI_META_TIMESIG:
-                e->param_len = *(*p)++; /* 4 */
-                e->params[0] = *(*p)++;
-                e->params[1] = *(*p)++;
-                e->params[2] = *(*p)++;
-                e->params[3] = *(*p)++;
-                break;
-            case MIDI_META_KEYSIG:
-                e->param_len = *(*p)++; /* 2 */
-                e->params[0] = *(*p)++;
-                e->params[1] = *(*p)++;
-                break;
-            case MIDI_META_PROPR:
-                break;
-            }
+            /* Every meta event, known or not, gives its length */
+            e->meta = *(*p)++;
+            e->varlen = read_varlen(p);
+            e->is_ascii = e->meta >= MIDI_META_TEXT &&
+                          e->meta <= MIDI_META_DEV_NAME;
             break;
         }
         break;
     }     
+
+    if(*p > end || e->varlen > end - *p) {
+        *err = MIDI_ERR_TRUNC;
+        free(e);
+        return NULL;
+    }
+    if(e->status == MIDI_CMD_SYS_RESET || e->status == MIDI_CMD_SYSEX_START ||
+       e->status == MIDI_CMD_SYSEX_END)
+        read_data(e, p);
+    *err = MIDI_OK;
+
     return e;
 }
 
-midi_track_t midi_read_track(void **m, midi_header_t *h)
+const char* midi_error_str(int err)
 {
-    int i;
-    uint8_t **p;
+    switch(err) {
+    case MIDI_OK:
+        return "no error";
+    case MIDI_ERR_TRUNC:
+        return "truncated event";
+    case MIDI_ERR_STATUS:
+        return "data byte without running status";
+    case MIDI_ERR_CHUNK:
+        return "truncated chunk";
+    }
+    return "unknown error";
+}
+
+midi_track_t midi_read_track(void **m, const uint8_t *end, midi_header_t *h)
+{
+    uint8_t **p = (uint8_t **) m;
+    uint8_t *base = *p, *chunk_end, last_status;
     midi_track_t t;
     midi_event_t *e, *old_e;
     uint32_t ppqn = h->time_div[0] << 8 | h->time_div[1];
+    uint32_t size, pos;
+    int err;
 
-    /* Copy id and chunk size */
-    memcpy(&t, *m, sizeof(t.id) + sizeof(t.size));
-    t.num_events = 0;
+    memset(&t, 0, sizeof(t));
     /* Default tempo of 120 bpm? */
     t.tempo = 500000;
-    t.pulse_len = 60000 / ((60000000/t.tempo) * ppqn);
-    t.patch = 0;
-    *(uint8_t *) m += sizeof(t.id) + sizeof(t.size);
+    t.pulse_len = midi_pulse_len(t.tempo, ppqn);
+
+    /* Skip chunks of unknown types */
+    for(;;) {
+        if(end - *p < sizeof(t.id) + sizeof(t.size)) {
+            t.error = MIDI_ERR_CHUNK;
+            t.error_pos = *p - base;
+            *p = (uint8_t *) end;
+            return t;
+        }
+        /* Copy id and chunk size */
+        memcpy(&t, *p, sizeof(t.id) + sizeof(t.size));
+        *p += sizeof(t.id) + sizeof(t.size);
+        size = chk_size_le(&t);
+        if(size > end - *p) {
+            t.error = MIDI_ERR_CHUNK;
+            t.error_pos = *p - base;
+            size = end - *p;
+        }
+        if(!memcmp(t.id, "MTrk", 4))
+            break;
+        *p += size;
+    }
 
-    for(i = 0; ; i++) {
-        e = midi_event_next(m, i > 0 ? old_e->status : 0);
+    /* Events stop at the chunk end, whether or not META_END is there */
+    chunk_end = *p + size;
+    old_e = NULL;
+    last_status = 0;
+    while(*p < chunk_end) {
+        pos = *p - base;
+        e = midi_event_next(m, chunk_end, last_status, &err);
+        /* Keep the first error, e.g. of a chunk running past the end */
+        if(err != MIDI_OK && t.error == MIDI_OK) {
+            t.error = err;
+            t.error_pos = pos;
+        }
+        if(e == NULL)
+            break;
 
-        if(i == 0)
+        if(old_e == NULL)
             t.events = e;
         else
             old_e->next = e;
@@ -192,9 +239,12 @@ midi_track_t midi_read_track(void **m, midi_header_t *h)
         old_e = e;
         t.num_events++;
 
-        if(e->meta == MIDI_META_TEMPO) {
+        /* Only channel messages set the running status */
+        if(e->status < MIDI_CMD_NON_MUS)
+            last_status = e->status;
+        if(e->meta == MIDI_META_TEMPO && e->param_len >= 3) {
             t.tempo = e->params[0] << 16 | e->params[1] << 8 | e->params[2];
-            t.pulse_len = 60000 / ((60000000/t.tempo) * ppqn);
+            t.pulse_len = midi_pulse_len(t.tempo, ppqn);
         }
         if((e->status & 0xF0) == MIDI_CMD_PATCH_CHG) {
            t.patch = e->params[0] & 0x7f;
@@ -202,6 +252,7 @@ midi_track_t midi_read_track(void **m, midi_header_t *h)
         if(e->meta == MIDI_META_END)
             break;
     }
+    *p = chunk_end;
 
     return t;
 }
@@ -62,7 +62,7 @@ typedef struct
 static inline uint32_t hdr_size_le(midi_header_t *h)
 {
     return (uint32_t)(h->size[3]       | h->size[2] << 8 |
-                      h->size[1] << 16 | h->size[0] << 24);
+                      h->size[1] << 16 | (uint32_t) h->size[0] << 24);
 }
 /* Big-endian format type access */
 static inline uint16_t hdr_type_le(midi_header_t *h)
@@ -80,6 +80,17 @@ static inline uint16_t hdr_tdiv_le(midi_header_t *h)
     return (uint32_t)(h->time_div[1] | h->time_div[0] << 8);
 }
 
+/* Pulse length in ms, from tempo (us per quarter note) and pulses per qn */
+static inline uint32_t midi_pulse_len(uint32_t tempo, uint32_t ppqn)
+{
+    uint32_t pulses_pm;
+
+    if(!tempo)
+        return 0;
+    pulses_pm = (60000000/tempo) * ppqn;
+    return pulses_pm ? 60000 / pulses_pm : 0;
+}
+
 
 /* MIDI Track Chunk structure. */
 typedef struct
@@ -100,6 +111,9 @@ typedef struct
     uint32_t pulse_len;
     /* Patch (instrument) */
     uint8_t patch;
+    /* Decoding error, if any, and its offset from where reading started */
+    int error;
+    uint32_t error_pos;
 
 } midi_track_t;
 
@@ -107,7 +121,7 @@ typedef struct
 static inline uint32_t chk_size_le(midi_track_t *t)
 {
     return (uint32_t)(t->size[3]       | t->size[2] << 8 |
-                      t->size[1] << 16 | t->size[0] << 24);
+                      t->size[1] << 16 | (uint32_t) t->size[0] << 24);
 }
 
 /* MIDI command mask*/
@@ -231,14 +245,38 @@ typedef struct __midi_event_t
 
 } midi_event_t;
 
-/* (Internal) Read variable-length dt used in event */
-/*static uint32_t read_varlen(uint8_t **m);*/
-
-/* Read the next MIDI event from memoru */
-midi_event_t* midi_event_next(void **m, uint8_t last_status);
-
-/* Read a whole track of events */
-midi_track_t midi_read_track(void **m, midi_header_t *h);
+/* Decoding errors */
+#define MIDI_OK             0
+/* An event runs past the end of its chunk */
+#define MIDI_ERR_TRUNC      -1
+/* A data byte where a status byte is needed */
+#define MIDI_ERR_STATUS     -2
+/* A chunk runs past the end of the file */
+#define MIDI_ERR_CHUNK      -3
+
+/* Bytes that must be readable, and should be 0, past the end of a buffer
+ * given to midi_event_next() and midi_read_track(); the fixed-size parts
+ * of an event are read without checks, and the end checked once after */
+#define MIDI_PAD 16
+
+/* Number of data bytes following a channel or system common status */
+int midi_cmd_param_len(uint8_t status);
+
+/* Fill in the params (and channel) of a channel or system common event from
+ * its raw data bytes; e->status must be set */
+void midi_event_set_params(midi_event_t *e, const uint8_t *data);
+
+/* Read the next MIDI event from memory, up to end; on error, returns NULL
+ * and sets err, leaving *m somewhere in the broken event */
+midi_event_t* midi_event_next(void **m, const uint8_t *end,
+                              uint8_t last_status, int *err);
+
+/* Read a whole track of events, skipping chunks that are not tracks, and
+ * leave *m after it; error tells why it ended early, at error_pos */
+midi_track_t midi_read_track(void **m, const uint8_t *end, midi_header_t *h);
+
+/* Error code to string */
+const char* midi_error_str(int err);
 
 /* Traverse and free the linked list of events */
 void midi_free_track(midi_track_t *t);
@@ -0,0 +1,146 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "noteidx.h"
+
+/* Latest end of notes [lo, hi), filling in max_end for that subtree */
+static uint32_t build_max_end(midi_note_index_t *idx, int lo, int hi)
+{
+    int mid;
+    uint32_t end, sub;
+
+    if(lo >= hi)
+        return 0;
+    mid = lo + (hi - lo) / 2;
+    end = idx->notes[mid].end;
+    if((sub = build_max_end(idx, lo, mid)) > end)
+        end = sub;
+    if((sub = build_max_end(idx, mid + 1, hi)) > end)
+        end = sub;
+    idx->max_end[mid] = end;
+
+    return end;
+}
+
+int midi_note_index_build(midi_note_index_t *idx, const midi_track_t *track)
+{
+    /* Index + 1 of the sounding note per channel/key, or 0 */
+    int sounding[16][128];
+    midi_event_t *e;
+    midi_note_t *n;
+    uint32_t clock;
+    uint8_t key;
+    int i, cap;
+
+    memset(idx, 0, sizeof(*idx));
+    memset(sounding, 0, sizeof(sounding));
+    clock = 0;
+    cap = 0;
+    e = track->events;
+    for(i = 0; i < track->num_events; i++, e = e->next) {
+        clock += e->dt;
+        if((e->status & 0xF0) != MIDI_CMD_NOTE_ON &&
+           (e->status & 0xF0) != MIDI_CMD_NOTE_OFF)
+            continue;
+
+        /* Any event on a sounding key ends it, as in the converter */
+        key = e->params[0] & 0x7F;
+        if(sounding[e->channel][key]) {
+            idx->notes[sounding[e->channel][key] - 1].end = clock;
+            sounding[e->channel][key] = 0;
+        }
+        if((e->status & 0xF0) == MIDI_CMD_NOTE_OFF || !e->params[1])
+            continue;
+
+        if(idx->num == cap) {
+            cap = cap ? cap * 2 : 64;
+            idx->notes = realloc(idx->notes, cap * sizeof(midi_note_t));
+        }
+        n = &idx->notes[idx->num++];
+        n->start = n->end = clock;
+        n->event = i;
+        n->key = key;
+        n->vel = e->params[1];
+        n->channel = e->channel;
+        sounding[e->channel][key] = idx->num;
+    }
+
+    /* Notes never released last until the end of the track */
+    for(i = 0; i < idx->num; i++) {
+        n = &idx->notes[i];
+        if(sounding[n->channel][n->key] == i + 1)
+            n->end = clock;
+    }
+
+    /* Events come in time order, so the notes are already sorted */
+    idx->max_end = malloc((idx->num + 1) * sizeof(uint32_t));
+    build_max_end(idx, 0, idx->num);
+
+    return idx->num;
+}
+
+static int query(const midi_note_index_t *idx, int lo, int hi, uint32_t t0,
+                 uint32_t t1, midi_note_fn fn, void *ctx)
+{
+    const midi_note_t *n;
+    int mid, found;
+
+    found = 0;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        /* Everything below here ends before the range */
+        if(idx->max_end[mid] <= t0)
+            break;
+        found += query(idx, lo, mid, t0, t1, fn, ctx);
+        /* This note and those after it start after the range */
+        n = &idx->notes[mid];
+        if(n->start >= t1)
+            break;
+        if(n->end > t0) {
+            if(fn != NULL)
+                fn(ctx, n);
+            found++;
+        }
+        lo = mid + 1;
+    }
+
+    return found;
+}
+
+int midi_note_index_range(const midi_note_index_t *idx, uint32_t t0,
+                          uint32_t t1, midi_note_fn fn, void *ctx)
+{
+    if(t1 <= t0)
+        return 0;
+    return query(idx, 0, idx->num, t0, t1, fn, ctx);
+}
+
+int midi_note_index_at(const midi_note_index_t *idx, uint32_t t,
+                       midi_note_fn fn, void *ctx)
+{
+    return midi_note_index_range(idx, t, t + 1, fn, ctx);
+}
+
+void midi_note_index_free(midi_note_index_t *idx)
+{
+    free(idx->notes);
+    free(idx->max_end);
+    memset(idx, 0, sizeof(*idx));
+}
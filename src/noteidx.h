@@ -0,0 +1,79 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NOTEIDX_H
+#define NOTEIDX_H
+
+/*
+ * Note interval index.
+ *
+ * Pairs the NOTE ON and NOTE OFF events of a track into notes with
+ * absolute start and end times, and answers which notes are sounding in
+ * a time range, or at a point in time, in O(log n + k) for k notes found.
+ * A note sounds from its start up to, but not including, its end.
+ *
+ * The notes are kept sorted by start time and viewed as an implicit
+ * balanced binary search tree (the root is the middle note of the array,
+ * and so on down), each node holding the latest end time of its subtree
+ * so that subtrees ending before the range are skipped.
+ */
+
+#include <stdint.h>
+
+#include "midi.h"
+
+/* A note of the track; times in pulses from the start of the track */
+typedef struct
+{
+    uint32_t start;
+    uint32_t end;
+    /* Index of the NOTE ON event in the track */
+    int event;
+    uint8_t key;
+    uint8_t vel;
+    uint8_t channel;
+
+} midi_note_t;
+
+typedef struct
+{
+    /* Notes by start time, then by order in the track */
+    midi_note_t *notes;
+    int num;
+    /* Latest end of the subtree rooted at each note */
+    uint32_t *max_end;
+
+} midi_note_index_t;
+
+/* Receives each note found, in start order */
+typedef void (*midi_note_fn)(void *ctx, const midi_note_t *n);
+
+/* Index the notes of a track; returns their number */
+int midi_note_index_build(midi_note_index_t *idx, const midi_track_t *track);
+
+/* Notes sounding at some point of [t0, t1); returns their number, and
+ * passes each to fn unless it is NULL */
+int midi_note_index_range(const midi_note_index_t *idx, uint32_t t0,
+                          uint32_t t1, midi_note_fn fn, void *ctx);
+
+/* Notes sounding at time t */
+int midi_note_index_at(const midi_note_index_t *idx, uint32_t t,
+                       midi_note_fn fn, void *ctx);
+
+void midi_note_index_free(midi_note_index_t *idx);
+
+#endif
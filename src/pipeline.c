@@ -0,0 +1,286 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "stream.h"
+
+/* Bytes read from the MIDI file at a time */
+#define READ_CHUNK 4096
+
+/* Items moved between the ends of a queue at a time, to limit locking */
+#define RING_BATCH 32
+
+/*
+ * Bounded single-producer/single-consumer queue.
+ *
+ * Each side works on slots it owns without locking, and hands them over
+ * to the other side (under the lock) in batches, or when it would block.
+ */
+typedef struct
+{
+    uint8_t *slots;
+    size_t elem_size;
+    uint32_t cap;
+
+    /* Shared, under lock: published items and released slots */
+    uint32_t tail, head;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+
+    /* Producer side: items written, and slots known to be free */
+    uint32_t p_tail, p_limit;
+    /* Consumer side: items read, and items known to be published */
+    uint32_t c_head, c_limit;
+
+} ring_t;
+
+static void ring_init(ring_t *r, size_t elem_size, uint32_t cap)
+{
+    memset(r, 0, sizeof(*r));
+    r->slots = malloc(elem_size * cap);
+    r->elem_size = elem_size;
+    r->cap = cap;
+    r->p_limit = cap;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+}
+
+static void ring_destroy(ring_t *r)
+{
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r->slots);
+}
+
+static void ring_publish(ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->tail = r->p_tail;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Producer: next free slot, waiting for one if need be */
+static void* ring_slot(ring_t *r)
+{
+    if(r->p_tail == r->p_limit) {
+        pthread_mutex_lock(&r->lock);
+        r->tail = r->p_tail;
+        pthread_cond_signal(&r->not_empty);
+        while(r->p_tail - r->head == r->cap)
+            pthread_cond_wait(&r->not_full, &r->lock);
+        r->p_limit = r->head + r->cap;
+        pthread_mutex_unlock(&r->lock);
+    }
+    return r->slots + (r->p_tail % r->cap) * r->elem_size;
+}
+
+/* Producer: the slot from ring_slot() is filled */
+static void ring_produce(ring_t *r)
+{
+    if(++r->p_tail - r->tail >= RING_BATCH)
+        ring_publish(r);
+}
+
+/* Producer: no more items */
+static void ring_close(ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->tail = r->p_tail;
+    r->closed = 1;
+    pthread_cond_broadcast(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_release(ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->head = r->c_head;
+    pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Consumer: next item, waiting for one; NULL once closed and empty */
+static void* ring_next(ring_t *r)
+{
+    if(r->c_head == r->c_limit) {
+        pthread_mutex_lock(&r->lock);
+        r->head = r->c_head;
+        pthread_cond_signal(&r->not_full);
+        while(r->tail == r->c_head && !r->closed)
+            pthread_cond_wait(&r->not_empty, &r->lock);
+        r->c_limit = r->tail;
+        pthread_mutex_unlock(&r->lock);
+        if(r->c_head == r->c_limit)
+            return NULL;
+    }
+    return r->slots + (r->c_head % r->cap) * r->elem_size;
+}
+
+/* Consumer: done with the item from ring_next() */
+static void ring_consume(ring_t *r)
+{
+    if(++r->c_head - r->head >= RING_BATCH)
+        ring_release(r);
+}
+
+/* Decoded event, as queued for the converter */
+typedef struct
+{
+    int track;
+    uint32_t ppqn;
+    midi_event_t e;
+
+} pipe_event_t;
+
+typedef struct
+{
+    FILE *fmid;
+    FILE *fnotes;
+    chip16_file_conv_t fc;
+    midi_stream_t stream;
+    ring_t events;
+    ring_t packets;
+    /* Results of the decode and convert stages */
+    int decode_err;
+    int total;
+    /* Set if the decoder could not be started */
+    int aborted;
+
+} pipeline_t;
+
+static void decode_event(void *ctx, int track, midi_event_t *e)
+{
+    pipeline_t *pl = ctx;
+    pipe_event_t *pe = ring_slot(&pl->events);
+
+    pe->track = track;
+    pe->ppqn = hdr_tdiv_le(&pl->stream.hdr);
+    pe->e = *e;
+    ring_produce(&pl->events);
+}
+
+/* Stage 1: read and decode the file */
+static void* decode_stage(void *arg)
+{
+    pipeline_t *pl = arg;
+    uint8_t buf[READ_CHUNK];
+    size_t len;
+
+    midi_stream_init(&pl->stream, decode_event, pl);
+    while((len = fread(buf, 1, sizeof(buf), pl->fmid)) > 0) {
+        if(midi_stream_feed(&pl->stream, buf, len))
+            break;
+    }
+    pl->decode_err = midi_stream_finish(&pl->stream);
+    ring_close(&pl->events);
+
+    return NULL;
+}
+
+static void convert_sink(void *ctx, const int16_t *packet)
+{
+    pipeline_t *pl = ctx;
+
+    memcpy(ring_slot(&pl->packets), packet,
+           CHIP16_PACKET_WORDS * sizeof(int16_t));
+    ring_produce(&pl->packets);
+}
+
+/* Stage 2: pair notes and make packets */
+static void* convert_stage(void *arg)
+{
+    pipeline_t *pl = arg;
+    pipe_event_t *pe;
+
+    while((pe = ring_next(&pl->events)) != NULL) {
+        chip16_file_conv_event(&pl->fc, pe->ppqn, pe->track, &pe->e);
+        ring_consume(&pl->events);
+    }
+    if(!pl->aborted)
+        pl->total = chip16_file_conv_finish(&pl->fc);
+    ring_close(&pl->packets);
+
+    return NULL;
+}
+
+int pipeline_write(FILE *fmid, const char *fn_notes, int track,
+                   chip16_opts_t *opts)
+{
+    pipeline_t pl;
+    pthread_t decoder, converter;
+    int16_t *packet;
+    int fallback = 0;
+
+    memset(&pl, 0, sizeof(pl));
+    if((pl.fnotes = fopen(fn_notes, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_notes);
+        return -2;
+    }
+    pl.fmid = fmid;
+    ring_init(&pl.events, sizeof(pipe_event_t), PIPELINE_EVENTS);
+    ring_init(&pl.packets, CHIP16_PACKET_WORDS * sizeof(int16_t),
+              PIPELINE_PACKETS);
+    chip16_file_conv_init(&pl.fc, track, opts, convert_sink, &pl);
+
+    /* The converter waits for events, so it can be stopped if the decoder
+     * does not start; either way, convert on this thread instead */
+    if(pthread_create(&converter, NULL, convert_stage, &pl)) {
+        fallback = 1;
+    } else if(pthread_create(&decoder, NULL, decode_stage, &pl)) {
+        pl.aborted = 1;
+        ring_close(&pl.events);
+        pthread_join(converter, NULL);
+        fallback = 1;
+    }
+    if(fallback) {
+        fclose(pl.fnotes);
+        ring_destroy(&pl.events);
+        ring_destroy(&pl.packets);
+        printf("warning: could not start the pipeline threads, "
+               "converting on one thread ... ");
+        return chip16_write_stream(fmid, fn_notes, track, opts);
+    }
+
+    /* Stage 3, on this thread: write packets out */
+    while((packet = ring_next(&pl.packets)) != NULL) {
+        fwrite(packet, sizeof(int16_t), CHIP16_PACKET_WORDS, pl.fnotes);
+        ring_consume(&pl.packets);
+    }
+
+    pthread_join(decoder, NULL);
+    pthread_join(converter, NULL);
+    fclose(pl.fnotes);
+    ring_destroy(&pl.events);
+    ring_destroy(&pl.packets);
+
+    if(pl.decode_err)
+        printf("warning: MIDI stream error %d near byte %u\n",
+               pl.decode_err, pl.stream.offset);
+
+    return pl.decode_err || pl.total < 0 ? -1 : 1;
+}
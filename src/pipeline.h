@@ -0,0 +1,42 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/*
+ * Pipelined conversion.
+ *
+ * Reading and decoding the file, converting events to packets and
+ * writing packets out run as three threads, joined by bounded
+ * single-producer/single-consumer queues. The stages overlap I/O and
+ * CPU work, and memory use is fixed by the queue depths.
+ */
+
+#include <stdio.h>
+
+#include "chip16.h"
+
+/* Queue depths, in events and packets; powers of 2 */
+#define PIPELINE_EVENTS  256
+#define PIPELINE_PACKETS 1024
+
+/* Convert one track of fmid to fn_notes through the pipeline */
+int pipeline_write(FILE *fmid, const char *fn_notes, int track,
+                   chip16_opts_t *opts);
+
+#endif
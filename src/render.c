@@ -0,0 +1,343 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "render.h"
+#include "chip16.h"
+
+/* Samples per block */
+#define BLOCK 256
+
+/* Output level, leaving some headroom */
+#define GAIN 0.8f
+
+/* Envelope stage lengths in ms, per nibble value (Chip16 spec) */
+static const uint16_t attack_ms[16] = {
+    2, 8, 16, 24, 38, 56, 68, 80, 100, 250, 500, 800, 1000, 3000, 5000, 8000
+};
+static const uint16_t decay_ms[16] = {
+    6, 24, 48, 72, 114, 168, 204, 240, 300, 750, 1500, 2400, 3000, 9000,
+    15000, 24000
+};
+
+typedef struct
+{
+    FILE *f;
+    uint32_t rate;
+    /* Samples written, and FNV-1a hash of their bytes */
+    uint32_t samples;
+    uint32_t hash;
+    /* packet[3] is an envelope table index */
+    int env_index;
+    /* Waveform and volume (0 to 1) of the note being played */
+    int wave;
+    float vol;
+    /* Noise generator state */
+    uint32_t lfsr;
+
+    float osc[BLOCK];
+    float env[BLOCK];
+    int16_t pcm[BLOCK];
+    uint8_t bytes[2 * BLOCK];
+
+} render_t;
+
+/* Triangle wave for phase, phase + inc, ...; phase in [0, 1) */
+static void osc_triangle(float *out, int n, float phase, float inc)
+{
+    int i;
+    float x;
+
+    for(i = 0; i < n; i++) {
+        x = phase + i * inc;
+        x -= (int) x;
+        out[i] = 4.0f * fabsf(x - 0.5f) - 1.0f;
+    }
+}
+
+static void osc_sawtooth(float *out, int n, float phase, float inc)
+{
+    int i;
+    float x;
+
+    for(i = 0; i < n; i++) {
+        x = phase + i * inc;
+        x -= (int) x;
+        out[i] = 2.0f * x - 1.0f;
+    }
+}
+
+static void osc_pulse(float *out, int n, float phase, float inc)
+{
+    int i;
+    float x;
+
+    for(i = 0; i < n; i++) {
+        x = phase + i * inc;
+        x -= (int) x;
+        out[i] = x < 0.5f ? 1.0f : -1.0f;
+    }
+}
+
+/* White noise from a xorshift generator; not vectorized, but cheap */
+static void osc_noise(float *out, int n, uint32_t *lfsr)
+{
+    int i;
+    uint32_t x = *lfsr;
+
+    for(i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        out[i] = (int32_t) x * (1.0f / 2147483648.0f);
+    }
+    *lfsr = x;
+}
+
+/* Linear envelope segment */
+static void env_ramp(float *out, int n, float level, float slope)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        out[i] = level + i * slope;
+}
+
+static void mix_pcm(int16_t *pcm, const float *osc, const float *env, int n,
+                    float gain)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        pcm[i] = (int16_t)(osc[i] * env[i] * gain);
+}
+
+static void write_block(render_t *r, int n)
+{
+    int i;
+
+    /* WAV samples are little-endian */
+    for(i = 0; i < n; i++) {
+        r->bytes[2 * i] = r->pcm[i] & 0xFF;
+        r->bytes[2 * i + 1] = (r->pcm[i] >> 8) & 0xFF;
+    }
+    for(i = 0; i < 2 * n; i++)
+        r->hash = (r->hash ^ r->bytes[i]) * 16777619;
+    fwrite(r->bytes, 1, 2 * n, r->f);
+    r->samples += n;
+}
+
+static void write_silence(render_t *r, uint32_t len)
+{
+    uint32_t n;
+
+    memset(r->pcm, 0, sizeof(r->pcm));
+    for(; len; len -= n) {
+        n = len < BLOCK ? len : BLOCK;
+        write_block(r, n);
+    }
+}
+
+/* Play samples [t0, t1) of a note, clipped to len, ramping from l0 to l1 */
+static void render_span(render_t *r, uint32_t t0, uint32_t t1, float l0,
+                        float l1, uint32_t len, float *phase, float inc)
+{
+    float slope;
+    uint32_t t, n;
+
+    if(t1 <= t0 || t0 >= len)
+        return;
+    slope = (l1 - l0) / (t1 - t0);
+    if(t1 > len)
+        t1 = len;
+
+    for(t = t0; t < t1; t += n) {
+        n = t1 - t < BLOCK ? t1 - t : BLOCK;
+        switch(r->wave) {
+        case CHIP16_WAVE_SAWTOOTH:
+            osc_sawtooth(r->osc, n, *phase, inc);
+            break;
+        case CHIP16_WAVE_PULSE:
+            osc_pulse(r->osc, n, *phase, inc);
+            break;
+        case CHIP16_WAVE_NOISE:
+            osc_noise(r->osc, n, &r->lfsr);
+            break;
+        default:
+            osc_triangle(r->osc, n, *phase, inc);
+            break;
+        }
+        env_ramp(r->env, n, l0 + (t - t0) * slope, slope);
+        mix_pcm(r->pcm, r->osc, r->env, n, GAIN * 32767.0f * r->vol);
+        write_block(r, n);
+        *phase = fmodf(*phase + n * inc, 1.0f);
+    }
+}
+
+/* ADSR word of a packet, setting up its waveform and volume */
+static uint16_t packet_adsr(render_t *r, const int16_t *packet)
+{
+    uint16_t ad, vtsr;
+
+    r->wave = CHIP16_WAVE_TRIANGLE;
+    r->vol = 1.0f;
+    if(!r->env_index)
+        return packet[3];
+    if(!chip16_envelope(packet[3], &ad, &vtsr))
+        return 0;
+    r->wave = (vtsr >> 8) & 0xF;
+    r->vol = (vtsr >> 12) / 15.0f;
+    return ad << 8 | (vtsr & 0xFF);
+}
+
+/* Length of a note and its release, in samples */
+static uint32_t note_len(render_t *r, const int16_t *packet)
+{
+    uint16_t adsr = packet_adsr(r, packet);
+
+    return ((uint32_t)(uint16_t) packet[2] + decay_ms[adsr & 0xF]) *
+           r->rate / 1000;
+}
+
+/* Play a packet for len samples, until the next one starts */
+static void render_note(render_t *r, const int16_t *packet, uint32_t len)
+{
+    uint16_t adsr = packet_adsr(r, packet);
+    uint32_t a, d, on, rel, end;
+    float s, l_on, phase, inc;
+
+    a = attack_ms[(adsr >> 12) & 0xF] * r->rate / 1000;
+    d = decay_ms[(adsr >> 8) & 0xF] * r->rate / 1000;
+    s = ((adsr >> 4) & 0xF) / 15.0f;
+    rel = decay_ms[adsr & 0xF] * r->rate / 1000;
+    on = (uint32_t)(uint16_t) packet[2] * r->rate / 1000;
+    phase = 0.0f;
+    inc = (float) packet[1] / r->rate;
+
+    /* Level when the note is released, maybe before sustain */
+    if(on < a)
+        l_on = (float) on / a;
+    else if(on < a + d)
+        l_on = 1.0f + (s - 1.0f) * (on - a) / d;
+    else
+        l_on = s;
+
+    render_span(r, 0, a < on ? a : on, 0.0f, a < on ? 1.0f : l_on,
+                len, &phase, inc);
+    if(a < on)
+        render_span(r, a, a + d < on ? a + d : on, 1.0f,
+                    a + d < on ? s : l_on, len, &phase, inc);
+    if(a + d < on)
+        render_span(r, a + d, on, s, s, len, &phase, inc);
+    render_span(r, on, on + rel, l_on, 0.0f, len, &phase, inc);
+
+    end = on + rel < len ? on + rel : len;
+    write_silence(r, len - end);
+}
+
+static void put_le(uint8_t *b, uint32_t v, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        b[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static void write_wav_header(render_t *r)
+{
+    uint8_t h[44];
+
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + r->samples * 2, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    /* PCM, mono, 16 bits */
+    put_le(h + 20, 1, 2);
+    put_le(h + 22, 1, 2);
+    put_le(h + 24, r->rate, 4);
+    put_le(h + 28, r->rate * 2, 4);
+    put_le(h + 32, 2, 2);
+    put_le(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, r->samples * 2, 4);
+    fwrite(h, 1, sizeof(h), r->f);
+}
+
+int render_notes(const char *fn_notes, const char *fn_wav, uint32_t rate,
+                 int env_index)
+{
+    FILE *fnotes;
+    render_t r;
+    int16_t *packets;
+    long size;
+    int i, num;
+    uint32_t len;
+    clock_t t;
+
+    if((fnotes = fopen(fn_notes, "rb")) == NULL) {
+        printf("error: could not open %s for reading\n", fn_notes);
+        return -2;
+    }
+    fseek(fnotes, 0, SEEK_END);
+    size = ftell(fnotes);
+    fseek(fnotes, 0, SEEK_SET);
+    num = size / (CHIP16_PACKET_WORDS * sizeof(int16_t));
+    packets = malloc(size + 1);
+    num = fread(packets, CHIP16_PACKET_WORDS * sizeof(int16_t), num, fnotes);
+    fclose(fnotes);
+
+    memset(&r, 0, sizeof(r));
+    if((r.f = fopen(fn_wav, "wb")) == NULL) {
+        printf("error: could not open %s for writing\n", fn_wav);
+        free(packets);
+        return -2;
+    }
+    r.rate = rate;
+    r.hash = 2166136261u;
+    r.env_index = env_index;
+    r.lfsr = 0x12345678;
+    t = clock();
+
+    /* Placeholder header until the length is known */
+    write_wav_header(&r);
+    for(i = 0; i < num; i++) {
+        int16_t *p = packets + i * CHIP16_PACKET_WORDS;
+
+        if(i == 0)
+            write_silence(&r, (uint32_t)(uint16_t) p[0] * rate / 1000);
+        if(i + 1 < num)
+            len = (uint32_t)(uint16_t) p[CHIP16_PACKET_WORDS] * rate / 1000;
+        else
+            len = note_len(&r, p);
+        render_note(&r, p, len);
+    }
+    fseek(r.f, 0, SEEK_SET);
+    write_wav_header(&r);
+    fclose(r.f);
+    free(packets);
+
+    printf("rendered %.1f s of audio in %.3f s, fingerprint %08x\n",
+           (double) r.samples / rate, (double)(clock() - t) / CLOCKS_PER_SEC,
+           r.hash);
+
+    return 1;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+/*
+ * Offline audio rendering of Chip16 note packets.
+ *
+ * Plays a notes file the way the single Chip16 voice would: each packet
+ * starts its note (cutting the previous one) after its delay, and holds
+ * it for its duration with the envelope of its ADSR word, whose nibbles
+ * are attack, decay, sustain and release as for the SNG instruction, or
+ * with the waveform and volume of its envelope table entry if env_index.
+ * Samples are produced in fixed-size blocks by simple loops the compiler
+ * can vectorize, and streamed to a 16-bit mono WAV file.
+ */
+
+#include <stdint.h>
+
+#define RENDER_RATE 44100
+
+/* Render fn_notes to fn_wav; prints a fingerprint of the samples */
+int render_notes(const char *fn_notes, const char *fn_wav, uint32_t rate,
+                 int env_index);
+
+#endif
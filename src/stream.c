@@ -0,0 +1,362 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "stream.h"
+
+/* Decoder states */
+enum
+{
+    /* Collecting the 8 byte id + size header of a chunk */
+    ST_CHUNK,
+    /* Collecting the MThd fields */
+    ST_HDR,
+    /* Skipping the rest of a chunk */
+    ST_SKIP,
+    /* Event delta-time */
+    ST_DT,
+    /* Event status, or first data byte if running status */
+    ST_STATUS,
+    /* Channel/system common data bytes */
+    ST_PARAMS,
+    /* Meta-event type */
+    ST_META_TYPE,
+    /* Meta/SysEx variable length */
+    ST_LEN,
+    /* Meta/SysEx data bytes */
+    ST_DATA
+};
+
+#define HDR_CHUNK_LEN   8
+#define HDR_BODY_LEN    (sizeof(midi_header_t) - HDR_CHUNK_LEN)
+
+static void new_event(midi_stream_t *s)
+{
+    midi_event_t *e = &s->ev;
+
+    e->dt = 0;
+    e->status = 0;
+    e->meta = 0;
+    e->param_len = 0;
+    e->varlen = 0;
+    e->channel = 0;
+    e->is_ascii = 0;
+    e->next = NULL;
+    s->vlq = 0;
+    s->state = ST_DT;
+}
+
+static void emit(midi_stream_t *s)
+{
+    midi_event_t *e = &s->ev;
+
+    /* Keep ASCII params printable as C strings */
+    if(e->param_len < MIDI_CMD_MAX_SIZE)
+        e->params[e->param_len] = '\0';
+    s->cb(s->ctx, s->track, e);
+
+    if(s->wire)
+        s->state = ST_STATUS;
+    else if(e->status == MIDI_CMD_SYS_RESET && e->meta == MIDI_META_END)
+        s->state = ST_SKIP;
+    else
+        new_event(s);
+}
+
+static void start_chunk(midi_stream_t *s)
+{
+    uint8_t *c = s->chunk;
+
+    s->chunk_pos = 0;
+    s->chunk_left = (uint32_t)(c[7] | c[6] << 8 | c[5] << 16) |
+                    (uint32_t) c[4] << 24;
+
+    if(!s->hdr.id[0]) {
+        if(memcmp(c, "MThd", 4) || s->chunk_left < HDR_BODY_LEN) {
+            s->error = MIDI_STREAM_ERR_HEADER;
+            return;
+        }
+        memcpy(&s->hdr, c, HDR_CHUNK_LEN);
+        s->data_pos = 0;
+        s->state = ST_HDR;
+    } else if(!memcmp(c, "MTrk", 4)) {
+        s->track++;
+        s->last_status = 0;
+        new_event(s);
+    } else {
+        s->state = ST_SKIP;
+    }
+
+    if(!s->chunk_left)
+        s->state = ST_CHUNK;
+}
+
+/* Handle the status byte, or the first data byte under running status */
+static void read_status(midi_stream_t *s, uint8_t c)
+{
+    midi_event_t *e = &s->ev;
+    int running = 0;
+
+    if(c & MIDI_CMD_FLAG) {
+        e->status = c;
+    } else {
+        e->status = s->last_status;
+        running = 1;
+    }
+
+    switch(e->status) {
+    case MIDI_CMD_SYS_RESET:
+        s->state = ST_META_TYPE;
+        return;
+    case MIDI_CMD_SYSEX_START:
+    case MIDI_CMD_SYSEX_END:
+        s->vlq = 0;
+        s->state = ST_LEN;
+        return;
+    case 0:
+        s->error = MIDI_STREAM_ERR_STATUS;
+        return;
+    }
+
+    if(e->status < MIDI_CMD_NON_MUS)
+        s->last_status = e->status;
+    s->data_pos = 0;
+    if(running)
+        e->params[s->data_pos++] = c;
+    s->data_left = midi_cmd_param_len(e->status) - s->data_pos;
+    if(s->data_left) {
+        s->state = ST_PARAMS;
+    } else {
+        /* Raw data is decoded in place */
+        midi_event_set_params(e, e->params);
+        emit(s);
+    }
+}
+
+/* Meta/SysEx length known; collect the data */
+static void read_len(midi_stream_t *s)
+{
+    midi_event_t *e = &s->ev;
+
+    e->varlen = s->vlq;
+    e->param_len = s->vlq < MIDI_CMD_MAX_SIZE ? s->vlq : MIDI_CMD_MAX_SIZE;
+    e->is_ascii = e->status == MIDI_CMD_SYS_RESET &&
+                  e->meta >= MIDI_META_TEXT && e->meta <= MIDI_META_DEV_NAME;
+    s->data_pos = 0;
+    s->data_left = s->vlq;
+    if(s->data_left)
+        s->state = ST_DATA;
+    else
+        emit(s);
+}
+
+void midi_stream_init(midi_stream_t *s, midi_stream_cb cb, void *ctx)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = ST_CHUNK;
+    s->track = -1;
+    s->cb = cb;
+    s->ctx = ctx;
+}
+
+void midi_stream_init_wire(midi_stream_t *s, midi_stream_cb cb, void *ctx)
+{
+    midi_stream_init(s, cb, ctx);
+    s->wire = 1;
+    s->track = 0;
+    new_event(s);
+    s->state = ST_STATUS;
+}
+
+/* Data byte of a message started earlier, or under running status */
+static void wire_data(midi_stream_t *s, uint8_t c)
+{
+    midi_event_t *e = &s->ev;
+
+    switch(s->state) {
+    case ST_DATA:
+        if(s->data_pos < MIDI_CMD_MAX_SIZE)
+            e->params[s->data_pos] = c;
+        s->data_pos++;
+        return;
+    case ST_STATUS:
+        /* Stray data bytes are dropped */
+        if(!s->last_status)
+            return;
+        new_event(s);
+        e->status = s->last_status;
+        s->data_pos = 0;
+        s->data_left = midi_cmd_param_len(e->status);
+        s->state = ST_PARAMS;
+        break;
+    }
+
+    e->params[s->data_pos++] = c;
+    if(!--s->data_left) {
+        midi_event_set_params(e, e->params);
+        emit(s);
+    }
+}
+
+static void wire_status(midi_stream_t *s, uint8_t c)
+{
+    midi_event_t *e = &s->ev;
+
+    /* Any status byte ends a SysEx */
+    if(s->state == ST_DATA) {
+        e->varlen = s->data_pos;
+        e->param_len = s->data_pos < MIDI_CMD_MAX_SIZE ?
+                       s->data_pos : MIDI_CMD_MAX_SIZE;
+        emit(s);
+    }
+    if(c == MIDI_CMD_SYSEX_END)
+        return;
+
+    new_event(s);
+    e->status = c;
+    s->data_pos = 0;
+    /* Only channel messages set the running status */
+    s->last_status = c < MIDI_CMD_NON_MUS ? c : 0;
+    if(c == MIDI_CMD_SYSEX_START) {
+        s->state = ST_DATA;
+        return;
+    }
+    s->data_left = midi_cmd_param_len(c);
+    s->state = ST_PARAMS;
+    if(!s->data_left)
+        emit(s);
+}
+
+static int feed_wire(midi_stream_t *s, const uint8_t *buf, size_t len)
+{
+    midi_event_t rt;
+    size_t i;
+
+    memset(&rt, 0, sizeof(rt));
+    for(i = 0; i < len; i++) {
+        if(buf[i] >= MIDI_CMD_TIMING_CLK) {
+            /* Real-time messages are single bytes and do not interrupt */
+            rt.status = buf[i];
+            s->cb(s->ctx, s->track, &rt);
+        } else if(buf[i] & MIDI_CMD_FLAG) {
+            wire_status(s, buf[i]);
+        } else {
+            wire_data(s, buf[i]);
+        }
+    }
+    s->offset += len;
+    return MIDI_STREAM_OK;
+}
+
+int midi_stream_feed(midi_stream_t *s, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf, *end = buf + len;
+    uint32_t n, keep;
+    uint8_t c;
+
+    if(s->wire)
+        return feed_wire(s, buf, len);
+
+    while(p < end && !s->error) {
+        if(s->state == ST_CHUNK) {
+            s->chunk[s->chunk_pos++] = *p++;
+            if(s->chunk_pos == HDR_CHUNK_LEN)
+                start_chunk(s);
+            continue;
+        }
+
+        /* Bulk states: header body, skipped bytes and event data */
+        if(s->state == ST_HDR || s->state == ST_SKIP || s->state == ST_DATA) {
+            n = end - p < s->chunk_left ? end - p : s->chunk_left;
+            if(s->state == ST_HDR) {
+                if(n > HDR_BODY_LEN - s->data_pos)
+                    n = HDR_BODY_LEN - s->data_pos;
+                memcpy((uint8_t *) &s->hdr + HDR_CHUNK_LEN + s->data_pos, p, n);
+                s->data_pos += n;
+                if(s->data_pos == HDR_BODY_LEN)
+                    s->state = ST_SKIP;
+            } else if(s->state == ST_DATA) {
+                if(n > s->data_left)
+                    n = s->data_left;
+                /* Only the first MIDI_CMD_MAX_SIZE bytes are kept */
+                if(s->data_pos < MIDI_CMD_MAX_SIZE) {
+                    keep = MIDI_CMD_MAX_SIZE - s->data_pos;
+                    memcpy(s->ev.params + s->data_pos, p, n < keep ? n : keep);
+                }
+                s->data_pos += n;
+                s->data_left -= n;
+            }
+            p += n;
+            s->chunk_left -= n;
+            if(s->state == ST_DATA && !s->data_left)
+                emit(s);
+        } else {
+            c = *p++;
+            s->chunk_left--;
+
+            switch(s->state) {
+            case ST_DT:
+            case ST_LEN:
+                s->vlq = (s->vlq << 7) | (c & 0x7F);
+                if(c & 0x80)
+                    break;
+                if(s->state == ST_LEN) {
+                    read_len(s);
+                } else {
+                    s->ev.dt = s->vlq;
+                    s->state = ST_STATUS;
+                }
+                break;
+            case ST_STATUS:
+                read_status(s, c);
+                break;
+            case ST_PARAMS:
+                s->ev.params[s->data_pos++] = c;
+                if(!--s->data_left) {
+                    midi_event_set_params(&s->ev, s->ev.params);
+                    emit(s);
+                }
+                break;
+            case ST_META_TYPE:
+                s->ev.meta = c;
+                s->vlq = 0;
+                s->state = ST_LEN;
+                break;
+            }
+        }
+
+        if(!s->chunk_left && s->state != ST_CHUNK) {
+            /* A chunk may only end between events */
+            if(s->state != ST_SKIP && s->state != ST_DT)
+                s->error = MIDI_STREAM_ERR_TRUNC;
+            s->state = ST_CHUNK;
+        }
+    }
+
+    s->offset += p - buf;
+    return s->error;
+}
+
+int midi_stream_finish(midi_stream_t *s)
+{
+    if(s->wire)
+        return s->state == ST_STATUS ? MIDI_STREAM_OK : MIDI_STREAM_ERR_TRUNC;
+    if(!s->error && (s->state != ST_CHUNK || s->chunk_pos || !s->hdr.id[0]))
+        s->error = s->hdr.id[0] ? MIDI_STREAM_ERR_TRUNC : MIDI_STREAM_ERR_HEADER;
+    return s->error;
+}
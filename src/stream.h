@@ -0,0 +1,99 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+/*
+ *  Incremental decoder for standard MIDI files.
+ *
+ *  Unlike midi_read_track(), which needs the whole file in memory, the
+ *  stream decoder is fed bytes in chunks of any size (e.g. as they come
+ *  out of a pipe) and keeps its state between calls, so variable length
+ *  values, SysEx and meta data may be split anywhere.
+ *  Each event is handed to a callback as soon as its last byte is seen;
+ *  the event structure is reused, so only the current event is held.
+ *
+ *  In wire mode the input is the raw MIDI byte stream, as sent over a cable
+ *  or by a character device: there are no chunks nor delta-times, SysEx
+ *  runs until the next status byte, and real-time bytes (0xF8-0xFF) may
+ *  appear anywhere, even inside another message, without breaking it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "midi.h"
+
+/* Called for every complete event; track is the MTrk chunk index */
+typedef void (*midi_stream_cb)(void *ctx, int track, midi_event_t *e);
+
+/* Decoder error codes */
+#define MIDI_STREAM_OK          0
+#define MIDI_STREAM_ERR_HEADER  -1
+#define MIDI_STREAM_ERR_TRUNC   -2
+#define MIDI_STREAM_ERR_STATUS  -3
+
+typedef struct
+{
+    /* Current decoder state (internal) */
+    int state;
+    /* Raw MIDI wire protocol input instead of a file */
+    int wire;
+    /* File header; valid once the first track has started */
+    midi_header_t hdr;
+    /* Index of the current track chunk, -1 before the first */
+    int track;
+    /* Bytes left in the current chunk */
+    uint32_t chunk_left;
+    /* Status of the last channel event, for running status */
+    uint8_t last_status;
+
+    /* Partial chunk header */
+    uint8_t chunk[8];
+    int chunk_pos;
+    /* Partial variable length value */
+    uint32_t vlq;
+    /* Data bytes still expected, and already stored, for the event */
+    uint32_t data_left;
+    uint32_t data_pos;
+
+    /* Event being decoded */
+    midi_event_t ev;
+
+    midi_stream_cb cb;
+    void *ctx;
+    /* First error seen, or MIDI_STREAM_OK */
+    int error;
+    /* Total bytes consumed, for error reporting */
+    uint32_t offset;
+
+} midi_stream_t;
+
+/* Prepare a decoder; cb is called with ctx for each event */
+void midi_stream_init(midi_stream_t *s, midi_stream_cb cb, void *ctx);
+
+/* Prepare a decoder for raw MIDI bytes; events are reported as track 0 */
+void midi_stream_init_wire(midi_stream_t *s, midi_stream_cb cb, void *ctx);
+
+/* Decode the next len bytes of the file; returns the error code */
+int midi_stream_feed(midi_stream_t *s, const uint8_t *buf, size_t len);
+
+/* Signal end of input; returns an error if stopped inside an event */
+int midi_stream_finish(midi_stream_t *s);
+
+#endif
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Replays the recorded raw MIDI byte streams in test/live through a FIFO
+# into "midi16 --live", and checks the number of notes written and the
+# latency percentiles it reports against the latency bound.
+#
+# Each recording names its bound and expected notes, and may give
+# conversion options, in comments:
+#   # latency <ms>
+#   # notes <n>
+#   # options <options>
+
+dir=$(dirname "$0")
+bin=${MIDI16:-./midi16}
+replay=${REPLAY:-$dir/replay}
+# Scheduling and polling jitter allowed over the bound, in ms
+slack=${SLACK:-25}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+for rec in "$dir"/live/*.rec; do
+    latency=$(sed -n 's/^# latency \([0-9]*\)$/\1/p' "$rec")
+    expect=$(sed -n 's/^# notes \([0-9]*\)$/\1/p' "$rec")
+    opts=$(sed -n 's/^# options \(.*\)$/\1/p' "$rec")
+    mkfifo "$tmp/fifo" || exit 1
+
+    "$bin" --live "$tmp/fifo" --latency "$latency" $opts \
+        -o "$tmp/notes.bin" > "$tmp/out" &
+    pid=$!
+    "$replay" "$rec" "$tmp/fifo" > /dev/null
+    wait $pid
+    rm -f "$tmp/fifo"
+
+    notes=$(sed -n 's/^wrote \([0-9]*\) notes$/\1/p' "$tmp/out")
+    p50=$(sed -n 's/.* p50 \([0-9]*\) us.*/\1/p' "$tmp/out")
+    p99=$(sed -n 's/.* p99 \([0-9]*\) us.*/\1/p' "$tmp/out")
+    max=$(sed -n 's/.* max \([0-9]*\) us$/\1/p' "$tmp/out")
+    limit=$(( (latency + slack) * 1000 ))
+
+    if [ "$notes" != "$expect" ] || [ -z "$max" ] ||
+       [ "$p99" -gt "$limit" ] || [ "$max" -gt "$limit" ]; then
+        echo "FAIL $(basename "$rec"): $notes notes (expected $expect)," \
+             "p99 ${p99:-?} us, max ${max:-?} us, limit $limit us"
+        fail=1
+    else
+        echo "ok   $(basename "$rec"): $notes notes, p50 $p50 us," \
+             "p99 $p99 us, max $max us"
+    fi
+done
+
+exit $fail
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Converts every track of the MIDI files in test/modes in each mode that
+# writes one notes file, and checks that they all write the same packets
+# as the default in-memory mode. tempo.mid changes tempo between notes,
+# during held notes and in the tempo track.
+
+dir=$(dirname "$0")
+bin=${MIDI16:-./midi16}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+for mid in "$dir"/modes/*.mid; do
+    for track in 0 1 2; do
+        for opts in "" "--voice highest" "--drums --tempo 150"; do
+            rm -f "$tmp"/*.bin
+            "$bin" "$mid" -c $track $opts -o "$tmp/batch.bin" > /dev/null
+            "$bin" "$mid" -c $track $opts --stream -o "$tmp/stream.bin" \
+                > /dev/null
+            "$bin" - -c $track $opts -o "$tmp/stdin.bin" < "$mid" > /dev/null
+            "$bin" "$mid" -c $track $opts --pipeline -o "$tmp/pipeline.bin" \
+                > /dev/null
+            "$bin" "$mid" -c $track $opts --max-memory 1M \
+                -o "$tmp/budget.bin" > /dev/null
+            [ -f "$tmp/batch.bin" ] || continue
+
+            name="$(basename "$mid") track $track${opts:+ $opts}"
+            bad=0
+            for mode in stream stdin pipeline budget; do
+                if ! cmp -s "$tmp/batch.bin" "$tmp/$mode.bin"; then
+                    echo "FAIL $name: $mode differs from the default mode"
+                    bad=1
+                fi
+            done
+            [ $bad -eq 0 ] && echo "ok   $name"
+            fail=$((fail | bad))
+        done
+    done
+done
+
+exit $fail
@@ -0,0 +1,227 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the note interval index against a brute-force scan: on random
+ * tracks, the notes must pair as a linear walk of the events pairs them,
+ * and every range and point query must find exactly the notes that
+ * overlap it, in start order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/midi.h"
+#include "../src/noteidx.h"
+
+#define NUM_TRACKS  200
+#define NUM_QUERIES 500
+
+typedef struct
+{
+    const midi_note_t **found;
+    int num;
+
+} found_t;
+
+static void collect(void *ctx, const midi_note_t *n)
+{
+    found_t *f = ctx;
+
+    f->found[f->num++] = n;
+}
+
+/* A track of notes on few channels and keys, so that they overlap and
+ * the same key is often hit again while sounding */
+static void random_track(midi_track_t *t, int num_events, int max_dt)
+{
+    midi_event_t *e, *last;
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    last = NULL;
+    for(i = 0; i < num_events; i++) {
+        e = calloc(1, sizeof(midi_event_t));
+        e->dt = rand() % 4 ? rand() % (max_dt + 1) : 0;
+        e->channel = rand() % 3;
+        switch(rand() % 8) {
+        case 0:
+            e->status = MIDI_CMD_PATCH_CHG | e->channel;
+            e->param_len = 1;
+            break;
+        case 1: case 2: case 3:
+            e->status = MIDI_CMD_NOTE_OFF | e->channel;
+            e->param_len = 2;
+            break;
+        default:
+            e->status = MIDI_CMD_NOTE_ON | e->channel;
+            e->param_len = 2;
+            /* Some NOTE ONs with zero velocity, which are NOTE OFFs */
+            e->params[1] = rand() % 6 ? 1 + rand() % 127 : 0;
+            break;
+        }
+        e->params[0] = 60 + rand() % 6;
+        if(last == NULL)
+            t->events = e;
+        else
+            last->next = e;
+        last = e;
+        t->num_events++;
+    }
+}
+
+/* Notes of the track, paired by walking the events on from each NOTE ON */
+static int pair_notes(const midi_track_t *t, midi_note_t *notes)
+{
+    midi_event_t *e, *f;
+    uint32_t clock, end;
+    uint8_t key;
+    int i, num;
+
+    num = 0;
+    clock = 0;
+    for(i = 0, e = t->events; e != NULL; i++, e = e->next) {
+        clock += e->dt;
+        key = e->params[0];
+        if((e->status & 0xF0) != MIDI_CMD_NOTE_ON || !e->params[1])
+            continue;
+        /* Up to the next event on the key, or the end of the track */
+        end = clock;
+        for(f = e->next; f != NULL; f = f->next) {
+            end += f->dt;
+            if(((f->status & 0xF0) == MIDI_CMD_NOTE_ON ||
+                (f->status & 0xF0) == MIDI_CMD_NOTE_OFF) &&
+               f->channel == e->channel && f->params[0] == key)
+                break;
+        }
+        notes[num].start = clock;
+        notes[num].end = end;
+        notes[num].event = i;
+        notes[num].key = key;
+        notes[num].vel = e->params[1];
+        notes[num].channel = e->channel;
+        num++;
+    }
+
+    return num;
+}
+
+static int same_note(const midi_note_t *a, const midi_note_t *b)
+{
+    return a->start == b->start && a->end == b->end &&
+           a->event == b->event && a->key == b->key && a->vel == b->vel &&
+           a->channel == b->channel;
+}
+
+static int check_query(const midi_note_index_t *idx, uint32_t t0,
+                       uint32_t t1, int point, found_t *f)
+{
+    int i, j, num;
+
+    f->num = 0;
+    num = point ? midi_note_index_at(idx, t0, collect, f) :
+                  midi_note_index_range(idx, t0, t1, collect, f);
+    if(num != f->num) {
+        printf("FAIL: [%u, %u) returned %d but passed %d notes\n",
+               t0, t1, num, f->num);
+        return 0;
+    }
+    /* Nothing sounds in an empty range */
+    for(i = j = 0; i < idx->num && t0 < t1; i++) {
+        if(idx->notes[i].start >= t1 || idx->notes[i].end <= t0)
+            continue;
+        if(j == f->num || f->found[j] != &idx->notes[i]) {
+            printf("FAIL: [%u, %u) %s note %d (start %u, end %u)\n",
+                   t0, t1, j == f->num ? "missed" : "out of order at",
+                   i, idx->notes[i].start, idx->notes[i].end);
+            return 0;
+        }
+        j++;
+    }
+    if(j != f->num) {
+        printf("FAIL: [%u, %u) found %d notes, %d overlap\n",
+               t0, t1, f->num, j);
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    midi_track_t track;
+    midi_note_index_t idx;
+    midi_note_t *notes;
+    found_t f;
+    uint32_t span, t0, t1;
+    int t, q, i, num, num_events, queries, fail;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    fail = 0;
+    queries = 0;
+    for(t = 0; t < NUM_TRACKS && !fail; t++) {
+        /* Empty and tiny tracks too, and dense or sparse timing */
+        num_events = t < 4 ? t : rand() % 2000;
+        random_track(&track, num_events, t % 2 ? 4 : 200);
+
+        notes = malloc((num_events + 1) * sizeof(midi_note_t));
+        num = pair_notes(&track, notes);
+        if(midi_note_index_build(&idx, &track) != num || idx.num != num) {
+            printf("FAIL: track %d: %d notes indexed, %d paired\n",
+                   t, idx.num, num);
+            fail = 1;
+        }
+        for(i = 0; i < num && !fail; i++) {
+            if(!same_note(&idx.notes[i], &notes[i])) {
+                printf("FAIL: track %d: note %d differs\n", t, i);
+                fail = 1;
+            }
+        }
+
+        f.found = malloc((num + 1) * sizeof(midi_note_t *));
+        for(i = 0, span = 2; i < num; i++) {
+            if(notes[i].end + 2 > span)
+                span = notes[i].end + 2;
+        }
+        for(q = 0; q < NUM_QUERIES && !fail; q++, queries++) {
+            t0 = rand() % span;
+            t1 = q % 8 ? t0 + rand() % (span / 4 + 1) : t0;
+            /* Points, empty ranges, and queries on note boundaries */
+            if(num && q % 3 == 0)
+                t0 = notes[rand() % num].end;
+            if(num && q % 5 == 0)
+                t1 = notes[rand() % num].start;
+            if(!check_query(&idx, t0, t1, 0, &f) ||
+               !check_query(&idx, t0, t0 + 1, 1, &f)) {
+                printf("      in track %d of %d notes\n", t, num);
+                fail = 1;
+            }
+        }
+
+        free(f.found);
+        free(notes);
+        midi_note_index_free(&idx);
+        midi_free_track(&track);
+    }
+
+    if(!fail)
+        printf("ok   %d tracks, %d range and point queries\n", t, queries);
+
+    return fail;
+}
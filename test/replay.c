@@ -0,0 +1,107 @@
+/*
+ * This file is part of midi16.
+ *
+ * midi16 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * midi16 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with midi16. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays a recorded raw MIDI byte stream into a FIFO, in real time.
+ *
+ * A recording is text: each line holds a time in ms from the start and
+ * the bytes (in hex) that arrived then; lines starting with '#' are
+ * comments. The FIFO is closed at the end, which ends "midi16 --live".
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MAX_LINE 1024
+
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+    uint64_t now = mono_ns();
+
+    if(now >= t)
+        return;
+    ts.tv_sec = (t - now) / 1000000000;
+    ts.tv_nsec = (t - now) % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *frec;
+    char line[MAX_LINE], *p, *end;
+    uint8_t bytes[MAX_LINE / 2];
+    unsigned long ms;
+    uint64_t t0;
+    int fd, n, num = 0;
+
+    if(argc != 3) {
+        fprintf(stderr,"usage: %s <recording> <fifo>\n", argv[0]);
+        return 1;
+    }
+    if((frec = fopen(argv[1], "r")) == NULL) {
+        fprintf(stderr,"error: could not open %s\n", argv[1]);
+        return 1;
+    }
+    /* Blocks until the reader shows up */
+    if((fd = open(argv[2], O_WRONLY)) < 0) {
+        fprintf(stderr,"error: could not open %s for writing\n", argv[2]);
+        fclose(frec);
+        return 1;
+    }
+
+    t0 = mono_ns();
+    while(fgets(line, sizeof(line), frec) != NULL) {
+        if(line[0] == '#')
+            continue;
+        ms = strtoul(line, &end, 10);
+        if(end == line)
+            continue;
+        for(n = 0, p = end;; p = end) {
+            bytes[n] = strtoul(p, &end, 16);
+            if(end == p)
+                break;
+            n++;
+        }
+        sleep_until(t0 + (uint64_t) ms * 1000000);
+        if(write(fd, bytes, n) != n) {
+            fprintf(stderr,"error: write to %s failed\n", argv[2]);
+            break;
+        }
+        num += n;
+    }
+    close(fd);
+    fclose(frec);
+    printf("replayed %d bytes from %s\n", num, argv[1]);
+
+    return 0;
+}